@@ -49,6 +49,8 @@
 #ifndef _MEVCLI_H
 #define _MEVCLI_H
 
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 
@@ -63,6 +65,21 @@
 #define MEVCLI_MAX_ARGS			8	/* Max num of args for any command */
 #endif
 
+#ifndef MEVCLI_MAX_DEPTH
+#define MEVCLI_MAX_DEPTH		3	/* Max levels of sub-command tables */
+#endif
+
+#ifndef MEVCLI_DELIMS
+#define MEVCLI_DELIMS			""	/* Up to 8 chars separating args, besides whitespace */
+#endif
+
+#ifndef MEVCLI_FEAT_BATCH
+/* A line can hold several commands, separated by ";" (run the next
+ * regardless) or "&&" (run the next only if this one succeeded).
+ */
+#define MEVCLI_FEAT_BATCH		1
+#endif
+
 #ifndef MEVCLI_PROMPT
 #define MEVCLI_PROMPT			"> "	/* Prompt; could be set to a char* variable */
 #endif
@@ -79,15 +96,220 @@
 #if MEVCLI_HISTORY_BUFLEN <= MEVCLI_MAX_LINE_LEN
 #error "mevcli: Config MEVCLI_HISTORY_BUFLEN needs to be at least MEVCLI_MAX_LINE_LEN"
 #endif
+#if MEVCLI_HISTORY_BUFLEN > 65536
+#error "mevcli: Config MEVCLI_HISTORY_BUFLEN is too large"
+#endif
+
+#ifndef MEVCLI_HISTORY_SEARCH_LEN
+/* Longest string for ^R reverse history search; 0 removes the search */
+#define MEVCLI_HISTORY_SEARCH_LEN	32
+#endif
+
+#if MEVCLI_HISTORY_SEARCH_LEN > 255
+#error "mevcli: Config MEVCLI_HISTORY_SEARCH_LEN is too large"
+#endif
+
+#ifndef MEVCLI_FEAT_HISTORY_STORE
+/* Keep history in persistent storage (e.g. flash, or a file), through
+ * the callbacks given to mevcli_history_load().
+ */
+#define MEVCLI_FEAT_HISTORY_STORE	0
+#endif
+
+#ifndef MEVCLI_FEAT_HISTORY_COMPRESS
+/* Store a (top-level) command name at the start of a history entry as
+ * one byte, as well as any words from mevcli_set_history_dict(), so
+ * that more entries fit.
+ */
+#define MEVCLI_FEAT_HISTORY_COMPRESS	0
+#endif
 
 #ifndef MEVCLI_HISTORY_MAX_STRS
 /* This configures the maximum number of history strings; we assume most history
  * entries won't be full line-length entries, but similarly don't want too many
- * of these pointers going unused.
+ * of these pointers going unused.  Compressed entries are shorter still, so
+ * more of them are allowed for, or the buffer would never fill.
  */
+#if MEVCLI_FEAT_HISTORY_COMPRESS
+#define MEVCLI_HISTORY_MAX_STRS		((unsigned int)MEVCLI_HISTORY_BUFLEN/MEVCLI_MAX_LINE_LEN*5)
+#else
 #define MEVCLI_HISTORY_MAX_STRS		((unsigned int)MEVCLI_HISTORY_BUFLEN/MEVCLI_MAX_LINE_LEN*3)
 #endif
 #endif
+#else
+#undef MEVCLI_HISTORY_SEARCH_LEN
+#define MEVCLI_HISTORY_SEARCH_LEN	0
+#undef MEVCLI_FEAT_HISTORY_STORE
+#define MEVCLI_FEAT_HISTORY_STORE	0
+#undef MEVCLI_FEAT_HISTORY_COMPRESS
+#define MEVCLI_FEAT_HISTORY_COMPRESS	0
+#endif
+
+#ifndef MEVCLI_FEAT_CMD_INDEX
+/* Support a sorted index of the command table, so commands are found
+ * by binary search rather than a scan (see mevcli_set_cmd_index()).
+ */
+#define MEVCLI_FEAT_CMD_INDEX		0
+#endif
+
+#ifndef MEVCLI_TRIE_NODES
+/* Nodes in a trie of command names, built by mevcli_init(), or 0 for
+ * none.  With the trie, lookup cost depends only on the length of what
+ * was typed, and any unambiguous prefix of a command name matches it.
+ * One node is needed per distinct (case-insensitive) prefix of all
+ * command names, plus one; each costs 7 bytes of the context, so (unlike
+ * a const index from mevcli_build_cmd_index()) it is always in RAM.
+ */
+#define MEVCLI_TRIE_NODES		0
+#endif
+
+#ifndef MEVCLI_FEAT_COMPLETION
+#define MEVCLI_FEAT_COMPLETION		1	/* Tab completion */
+#endif
+
+#ifndef MEVCLI_FEAT_TYPED_ARGS
+/* Commands can describe their args (see mevcli_argspec_t), which are
+ * converted and checked before calling a handler with the values.
+ */
+#define MEVCLI_FEAT_TYPED_ARGS		0
+#endif
+
+#ifndef MEVCLI_FEAT_ASYNC
+/* Handlers can return MEVCLI_PENDING, and finish later by calling
+ * mevcli_cmd_complete(), or MEVCLI_YIELD, to be called again from
+ * mevcli_tick().  Meanwhile, up to MEVCLI_TYPEAHEAD_LEN chars of input
+ * are kept, to be processed once the command completes.
+ */
+#define MEVCLI_FEAT_ASYNC		0
+#endif
+
+#if MEVCLI_FEAT_ASYNC
+#ifndef MEVCLI_TYPEAHEAD_LEN
+#define MEVCLI_TYPEAHEAD_LEN		32
+#endif
+#ifndef MEVCLI_TASK_STATE_LEN
+#define MEVCLI_TASK_STATE_LEN		16	/* Bytes kept for a yielding handler */
+#endif
+#endif
+
+#ifndef MEVCLI_TERM_WIDTH
+#define MEVCLI_TERM_WIDTH		80	/* For listing completions */
+#endif
+
+#ifndef MEVCLI_FEAT_PRINTF
+#define MEVCLI_FEAT_PRINTF		1	/* mevcli_printf() for handlers */
+#endif
+
+#ifndef MEVCLI_FEAT_BRACKETED_PASTE
+/* Ask the terminal to bracket pasted text, which is then inserted in
+ * bulk rather than treated as keystrokes.  Multi-line pastes are
+ * buffered until the paste ends, then run line by line.
+ */
+#define MEVCLI_FEAT_BRACKETED_PASTE	0
+#endif
+
+#if MEVCLI_FEAT_BRACKETED_PASTE
+#ifndef MEVCLI_PASTE_BUFLEN
+#define MEVCLI_PASTE_BUFLEN		256	/* Max bytes in one paste */
+#endif
+#endif
+
+#ifndef MEVCLI_OUTBUF_LEN
+/* Bytes of output staging buffer; output is collected here and passed
+ * in spans to an output callback registered with mevcli_set_output_buf().
+ * 0 disables buffering, and every byte goes to cb_output_char() directly.
+ */
+#define MEVCLI_OUTBUF_LEN		0
+#endif
+
+#ifndef MEVCLI_TXRING_LEN
+/* Bytes of transmit ring (a power of two), or 0 for none.  When
+ * configured, all output is written into the ring and never waits;
+ * the application drains it using mevcli_tx_take()/mevcli_tx_done(),
+ * e.g. from a DMA completion or TX-empty interrupt.  This replaces
+ * MEVCLI_OUTBUF_LEN staging.
+ */
+#define MEVCLI_TXRING_LEN		0
+#endif
+
+#if MEVCLI_TXRING_LEN > 0
+#if (MEVCLI_TXRING_LEN & (MEVCLI_TXRING_LEN - 1)) != 0
+#error "mevcli: Config MEVCLI_TXRING_LEN must be a power of two"
+#endif
+#if MEVCLI_OUTBUF_LEN > 0
+#error "mevcli: Config MEVCLI_TXRING_LEN and MEVCLI_OUTBUF_LEN are exclusive"
+#endif
+
+#ifndef MEVCLI_TXRING_HIGHWATER
+#define MEVCLI_TXRING_HIGHWATER		(MEVCLI_TXRING_LEN*3/4)
+#endif
+#ifndef MEVCLI_TXRING_LOWWATER
+#define MEVCLI_TXRING_LOWWATER		(MEVCLI_TXRING_LEN/4)
+#endif
+#endif
+
+#ifndef MEVCLI_RXRING_LEN
+/* Bytes of receive ring (a power of two), or 0 for none.  This lets an
+ * RX interrupt handler queue input with mevcli_isr_push(), for the main
+ * program to later process with mevcli_poll().
+ */
+#define MEVCLI_RXRING_LEN		0
+#endif
+
+#if MEVCLI_RXRING_LEN > 0
+#if (MEVCLI_RXRING_LEN & (MEVCLI_RXRING_LEN - 1)) != 0
+#error "mevcli: Config MEVCLI_RXRING_LEN must be a power of two"
+#endif
+
+#ifndef MEVCLI_RXRING_XOFF
+#define MEVCLI_RXRING_XOFF		(MEVCLI_RXRING_LEN*3/4)	/* Flow off at this fill */
+#endif
+#ifndef MEVCLI_RXRING_XON
+#define MEVCLI_RXRING_XON		(MEVCLI_RXRING_LEN/4)	/* Flow back on below this */
+#endif
+#endif
+
+#ifndef MEVCLI_LOG_BUFLEN
+/* Bytes of log message ring (a power of two), or 0 for none.  Messages
+ * queued with mevcli_log() are drawn above the prompt in batches.
+ */
+#define MEVCLI_LOG_BUFLEN		0
+#endif
+
+#if MEVCLI_LOG_BUFLEN > 0
+#if (MEVCLI_LOG_BUFLEN & (MEVCLI_LOG_BUFLEN - 1)) != 0
+#error "mevcli: Config MEVCLI_LOG_BUFLEN must be a power of two"
+#endif
+#endif
+
+/* Terminal capabilities, beyond basic cursor positioning and erase:
+ *
+ * MEVCLI_TERM_CAP_ICH_DCH:	Insert/delete character (ESC[n@, ESC[nP),
+ *				supported by most terminals from the VT102 on.
+ *				Mid-line edits then only send the changed
+ *				chars, rather than repainting the line tail.
+ */
+#define MEVCLI_TERM_CAP_ICH_DCH		1
+
+#ifndef MEVCLI_TERM_CAPS
+#define MEVCLI_TERM_CAPS		MEVCLI_TERM_CAP_ICH_DCH	/* Initial caps */
+#endif
+
+#ifndef MEVCLI_BARRIER
+/* Orders ring buffer accesses between an interrupt handler and the
+ * main program.  A compiler barrier is enough on a single core;
+ * override with a real fence (e.g. __sync_synchronize()) for SMP.
+ */
+#define MEVCLI_BARRIER()		__asm__ __volatile__("" ::: "memory")
+#endif
+
+#ifndef MEVCLI_MACHINE_TERM
+/* In machine mode, each command's completion is reported by a line
+ * starting with this, followed by "<seq> <status>".  The default (ASCII
+ * RS) can't be confused with regular text output.
+ */
+#define MEVCLI_MACHINE_TERM		"\x1e"
+#endif
 
 #ifndef MEVCLI_ASSERT
 #define MEVCLI_ASSERT(x)		do {} while(0)
@@ -97,6 +319,111 @@
 ////////////////////////////////////////////////////////////////////////////////
 // User-visible types
 
+typedef struct mevcli_ctx mevcli_ctx_t;
+
+/* Command status, as returned by ctxfn handlers (below) and reported in
+ * machine mode.  Handlers return MEVCLI_OK or, for failure, any
+ * positive value; negative values are reserved for mevcli's own errors.
+ */
+#define MEVCLI_OK		0
+#define MEVCLI_ERR_UNKNOWN	-1	/* Unknown command */
+#define MEVCLI_ERR_ARGS		-2	/* Incorrect number of args, or too many */
+#define MEVCLI_ERR_LINE		-3	/* Line too long */
+#define MEVCLI_ERR_AMBIGUOUS	-4	/* Command prefix matches several */
+#define MEVCLI_ERR_TYPE		-5	/* Arg doesn't match its argspec */
+#define MEVCLI_ERR_QUOTE	-6	/* Unterminated quote */
+
+/* Returned by a ctxfn/typedfn handler which is carrying on in the
+ * background (with MEVCLI_FEAT_ASYNC); see mevcli_cmd_complete().
+ */
+#define MEVCLI_PENDING		-64
+
+/* Returned by a ctxfn/typedfn handler which has done a slice of its
+ * work, to be called again (with the same args) from mevcli_tick().  It
+ * finishes by returning any other status.  The MEVCLI_PT_* macros help
+ * pick up where it left off: put the body between MEVCLI_PT_BEGIN(ctx)
+ * and MEVCLI_PT_END(ctx), and MEVCLI_PT_YIELD(ctx) returns
+ * MEVCLI_YIELD, carrying on after it on the next call.  As with
+ * protothreads, locals don't survive a yield (keep state in
+ * mevcli_task_state() instead), and a switch can't contain one.
+ */
+#define MEVCLI_YIELD		-65
+
+#define MEVCLI_PT_BEGIN(ctx)	switch ((ctx)->task_pt) { case 0:
+#define MEVCLI_PT_YIELD(ctx)	do { (ctx)->task_pt = __LINE__; return MEVCLI_YIELD; \
+				     case __LINE__:; } while (0)
+#define MEVCLI_PT_END(ctx)	} (ctx)->task_pt = 0
+
+/* Typed args (with MEVCLI_FEAT_TYPED_ARGS): a command's args can be
+ * described by an array of these, one per arg.  mevcli converts and
+ * checks all of them before calling the command's typedfn with the
+ * values.
+ *
+ * type:	MEVCLI_ARG_*, below.
+ * flags:	MEVCLI_ARGF_OPTIONAL: this and the following args may be
+ *		omitted.  MEVCLI_ARGF_REPEAT: on the last spec, further
+ *		args (up to MEVCLI_MAX_ARGS) are of the same type.
+ * min, max:	Inclusive range for MEVCLI_ARG_INT/MEVCLI_ARG_UINT (as
+ *		unsigned for the latter); not checked if both are 0.
+ * names:	For MEVCLI_ARG_ENUM, a NULL-terminated table of the words
+ *		accepted (case-insensitively).  The value is the index
+ *		of the one given.
+ */
+#define MEVCLI_ARG_STR		0	/* Passed as-is */
+#define MEVCLI_ARG_INT		1	/* Decimal, or hex with 0x, maybe with - */
+#define MEVCLI_ARG_UINT		2	/* Decimal, or hex with 0x */
+#define MEVCLI_ARG_BOOL		3	/* on/off, yes/no, true/false or 1/0 */
+#define MEVCLI_ARG_ENUM		4	/* One of names[] */
+
+#define MEVCLI_ARGF_OPTIONAL	1
+#define MEVCLI_ARGF_REPEAT	2
+
+typedef struct {
+	uint8_t type;
+	uint8_t flags;
+	int32_t min;
+	int32_t max;
+	const char *const *names;
+} mevcli_argspec_t;
+
+/* An arg value, as passed to typedfn: i for MEVCLI_ARG_INT, u for
+ * MEVCLI_ARG_UINT and MEVCLI_ARG_ENUM, b for MEVCLI_ARG_BOOL, s for
+ * MEVCLI_ARG_STR.
+ */
+typedef union {
+	int32_t i;
+	uint32_t u;
+	bool b;
+	const char *s;
+} mevcli_arg_t;
+
+/* A persistent history store (with MEVCLI_FEAT_HISTORY_STORE), such as
+ * a flash page or a file.  History is kept there as an append-only log
+ * of CRC-checked records, so each command entered costs one small
+ * write.  Only when the log is full is the store erased and the current
+ * history written back.
+ *
+ * size:	Bytes of storage; a few times MEVCLI_HISTORY_BUFLEN
+ *		means fewer rewrites
+ * read:	Read len bytes at offset into buf.  Bytes not written since
+ *		the last erase must read as 0xff, as for flash.
+ * write:	Write len bytes at offset.  Only bytes erased (and not
+ *		written) since are written, in increasing order, so flash
+ *		can be programmed directly.
+ * erase:	Erase the whole store (e.g. the flash page(s), or
+ *		truncate the file).
+ * opaque:	Passed to the callbacks
+ *
+ * The callbacks return 0, or a negative value for failure.
+ */
+typedef struct {
+	unsigned int size;
+	int (*read)(void *opaque, unsigned int offset, void *buf, unsigned int len);
+	int (*write)(void *opaque, unsigned int offset, const void *buf, unsigned int len);
+	int (*erase)(void *opaque);
+	void *opaque;
+} mevcli_hist_store_t;
+
 /* This struct defines a commmand; your application needs to create an
  * array of one or more mevcli_cmd_t structures and pass it to
  * mevcli_init().  The array must remain valid for the life of
@@ -108,33 +435,76 @@
  * cmdfn:	A function called in response to the command.  Arguments
  *		are passed as an array of strings (with argc of them;
  *		note unlike main(), argc=1 for one argument to the command,
- *		i.e. argv does not include the command name).
- * opaque:	A value passed to cmdfn() calls.
+ *		i.e. argv does not include the command name).  Args are
+ *		separated by whitespace (or MEVCLI_DELIMS); "..." or '...'
+ *		quote an arg containing them, and a backslash escapes the
+ *		next char (except within '...').  Quotes and escapes are
+ *		removed from the strings passed.
+ * ctxfn:	Alternative to cmdfn, additionally passed the mevcli
+ *		context (e.g. for mevcli_set_machine_mode()) and returning
+ *		a status (see MEVCLI_OK).  Only one of cmdfn/ctxfn is
+ *		needed; ctxfn is used if set.
+ * typedfn:	Alternative to ctxfn (used in preference to it, if set,
+ *		with MEVCLI_FEAT_TYPED_ARGS), which is passed the args
+ *		converted according to argspec.
+ * opaque:	A value passed to cmdfn()/ctxfn()/typedfn() calls.
  * nargs:	Number of expected args, or -1 for a variable number (in
  *		all cases up to the hard limit of MEVCLI_MAX_ARGS).
  *		Used to avoid having to check arg number in all commands.
+ *		Not used if there's an argspec.
+ * complete:	Optional, for tab completion of args: returns the n'th
+ *		possible value of arg argn (0 for the first arg), or NULL
+ *		if n is beyond the last.  mevcli picks out the ones
+ *		matching what's been typed.
+ * subcmds:	Optional table of num_subcmds sub-commands, e.g. "ifup"
+ *		and "ifdown" below "net".  The word after the command is
+ *		looked up in it, and so on down to MEVCLI_MAX_DEPTH
+ *		levels; the handler of the command reached is called
+ *		with the words after it as args.  A command with both
+ *		subcmds and a handler is called if the next word isn't
+ *		a sub-command (or there isn't one); one with no handler
+ *		needs a sub-command.
+ * subcmd_index: Optional (with MEVCLI_FEAT_CMD_INDEX) sorted index of
+ *		subcmds, as from mevcli_build_cmd_index(), so that the
+ *		level is searched by binary search.
+ * argspec:	Optional (with MEVCLI_FEAT_TYPED_ARGS) array of
+ *		num_argspecs arg descriptions, for typedfn.  Without
+ *		one, typedfn gets all args as MEVCLI_ARG_STR.
+ * cancel:	Optional (with MEVCLI_FEAT_ASYNC), called if ^C is typed
+ *		while the command is pending.  It should stop the
+ *		command, which then calls mevcli_cmd_complete() as usual
+ *		(possibly from within cancel()).
  */
-typedef struct {
+typedef struct mevcli_cmd {
 	const char *name;
 	const char *help;
 	void *opaque;
 	void (*cmdfn)(void *opaque, int argc, char **argv);
 	int nargs;
+	int (*ctxfn)(mevcli_ctx_t *ctx, void *opaque, int argc, char **argv);
+	const char *(*complete)(void *opaque, int argn, unsigned int n);
+	const struct mevcli_cmd *subcmds;
+	unsigned int num_subcmds;
+	const uint16_t *subcmd_index;
+	int (*typedfn)(mevcli_ctx_t *ctx, void *opaque, int argc, const mevcli_arg_t *argv);
+	const mevcli_argspec_t *argspec;
+	unsigned int num_argspecs;
+	void (*cancel)(mevcli_ctx_t *ctx, void *opaque);
 } mevcli_cmd_t;
 
 
 ////////////////////////////////////////////////////////////////////////////////
 // External API
 
-typedef struct mevcli_ctx mevcli_ctx_t;
-
 /* Init mevcli and register commands with it.
  *
  * cmds:		Array of mevcli_cmd_t descriptors of commands.
  *			Read-only and accessed in place, so must remain valid
  *			throughout usage.
  * num_cmds:		Number of array entries
- * cb_output_char:	Callback used to output characters
+ * cb_output_char:	Callback used to output characters.  May be NULL if
+ *			MEVCLI_OUTBUF_LEN is configured and a span callback
+ *			is registered with mevcli_set_output_buf() instead.
  */
 
 void	mevcli_init(mevcli_ctx_t *ctx,
@@ -146,6 +516,191 @@ void	mevcli_init(mevcli_ctx_t *ctx,
  */
 void	mevcli_input_char(mevcli_ctx_t *ctx, const char in);
 
+/* Pass a buffer of input characters to mevcli, e.g. a UART DMA buffer
+ * or pasted text.  Equivalent to calling mevcli_input_char() for each,
+ * except that runs of printable characters are inserted into the line
+ * in one step, with one redraw.
+ * buf:			Characters to input
+ * len:			Number of characters
+ */
+void	mevcli_input_buf(mevcli_ctx_t *ctx, const char *buf, unsigned int len);
+
+#if MEVCLI_FEAT_PRINTF
+/* Formatted output, e.g. from command handlers, through mevcli's output
+ * path (so buffered, if configured).  Supports %d, %u, %x/%X, %s, %c and
+ * %%, with a field width (padded with spaces, or zeros with a leading
+ * 0, or on the right with a leading -).  Numbers are int or unsigned
+ * int sized.
+ */
+void	mevcli_printf(mevcli_ctx_t *ctx, const char *fmt, ...);
+void	mevcli_vprintf(mevcli_ctx_t *ctx, const char *fmt, va_list ap);
+#endif
+
+/* Enter or leave machine mode, for driving mevcli from scripts.  In
+ * machine mode there is no echo, line editing, history, prompt or help
+ * text: input lines are run as they are received, and each is followed
+ * by a line of MEVCLI_MACHINE_TERM, a sequence number (from 0 on
+ * entering machine mode), a space, and the command's status (see
+ * MEVCLI_OK), e.g. "\x1e" "3 0\r\n".  This may be called from a ctxfn
+ * command handler; a command entering machine mode gets sequence 0.
+ */
+void	mevcli_set_machine_mode(mevcli_ctx_t *ctx, bool on);
+
+#if MEVCLI_FEAT_CMD_INDEX
+/* Give mevcli an index of the command table, i.e. num_cmds entries
+ * listing the table's indices in order of (case-insensitive) name.
+ * Commands are then found by binary search, so the cost of dispatch
+ * (including of unknown commands) no longer grows with table size.
+ * Like the table, the index is read in place, so can be const data
+ * alongside it; pass NULL to go back to scanning.
+ */
+void	mevcli_set_cmd_index(mevcli_ctx_t *ctx, const uint16_t *index);
+
+/* Build an index of cmds for mevcli_set_cmd_index().  Either call this
+ * at startup, into an array in RAM, or run it on the build host and
+ * emit the result as a const array to keep it in flash (as the example
+ * in test/ does).
+ */
+void	mevcli_build_cmd_index(const mevcli_cmd_t *cmds, unsigned int num_cmds,
+			       uint16_t *index);
+#endif
+
+#if MEVCLI_FEAT_ASYNC
+/* Finish a command whose handler returned MEVCLI_PENDING, with its
+ * status.  Until then, its argv stays valid, and input is kept rather
+ * than processed.  After this, any remaining commands on its line are
+ * run, the prompt output, and the kept input processed.  Call this from
+ * the same context as mevcli_input_char() and friends (not from an
+ * interrupt handler).
+ */
+void	mevcli_cmd_complete(mevcli_ctx_t *ctx, int status);
+
+/* Call a handler that returned MEVCLI_YIELD again, for its next slice of
+ * work.  Returns true if it's still not finished, i.e. there's more to
+ * do.  Call it from the main loop, from the same context as
+ * mevcli_input_char() and friends; mevcli_poll() also calls it.
+ */
+bool	mevcli_tick(mevcli_ctx_t *ctx);
+
+/* MEVCLI_TASK_STATE_LEN bytes of storage, for a yielding handler to keep
+ * state in from one slice to the next.  It is not cleared.
+ */
+void	*mevcli_task_state(mevcli_ctx_t *ctx);
+#endif
+
+/* The length of arg n, for a handler (as strlen(argv[n])) */
+unsigned int	mevcli_arg_len(mevcli_ctx_t *ctx, int n);
+
+/* Set terminal capabilities (MEVCLI_TERM_CAP_* flags), overriding the
+ * MEVCLI_TERM_CAPS default.  Pass 0 for dumb terminals.
+ */
+void	mevcli_set_term_caps(mevcli_ctx_t *ctx, unsigned int caps);
+
+#if MEVCLI_OUTBUF_LEN > 0
+/* Register a callback taking whole spans of output, which is used in
+ * preference to cb_output_char.  Output is staged in a buffer of
+ * MEVCLI_OUTBUF_LEN bytes, and passed on when the buffer fills or at the
+ * end of each mevcli_input_char().  Any output already staged (e.g. the
+ * prompt, if mevcli_init() was given a NULL cb_output_char) is passed
+ * on immediately.
+ */
+void	mevcli_set_output_buf(mevcli_ctx_t *ctx,
+			      void (*cb_output_buf)(const char *out, unsigned int len));
+#endif
+
+#if MEVCLI_RXRING_LEN > 0
+/* Queue an input character; intended to be called from an RX interrupt
+ * handler (the single producer), where command handlers must not run.
+ * If the ring is full, the character is lost and counted in
+ * ctx->rx_overflows.
+ */
+void	mevcli_isr_push(mevcli_ctx_t *ctx, char in);
+
+/* Process all queued input characters, as mevcli_input_buf() would.
+ * Call this from the main program/task (the single consumer).
+ */
+void	mevcli_poll(mevcli_ctx_t *ctx);
+
+/* Register an optional flow-control callback for the receive ring.  It
+ * is called with true from mevcli_isr_push() (i.e. in interrupt
+ * context) when the ring fills to MEVCLI_RXRING_XOFF, so the application
+ * can send XOFF or deassert RTS; and with false from mevcli_poll() once
+ * the ring drains below MEVCLI_RXRING_XON.
+ */
+void	mevcli_set_rx_flow(mevcli_ctx_t *ctx, void (*cb_rx_flow)(bool stop));
+#endif
+
+#if MEVCLI_TXRING_LEN > 0
+/* Register callbacks for the transmit ring:
+ *
+ * cb_tx_kick:		Called (from mevcli_input_char() etc.) when new
+ *			output has been queued, so the application can start
+ *			DMA or enable its TX-empty interrupt.
+ * cb_tx_highwater:	Optional (may be NULL).  Called with true when the
+ *			ring fills past MEVCLI_TXRING_HIGHWATER, and false
+ *			(from mevcli_tx_take() or mevcli_tx_done(), so in
+ *			the consumer's context) when it drains back below
+ *			MEVCLI_TXRING_LOWWATER; the application can use this
+ *			to hold off chatty commands.
+ *
+ * If output is already queued (e.g. the prompt), cb_tx_kick is called
+ * immediately.
+ */
+void	mevcli_set_tx_ring(mevcli_ctx_t *ctx, void (*cb_tx_kick)(void),
+			   void (*cb_tx_highwater)(bool above));
+
+/* Get the next contiguous chunk of queued output, returning its length
+ * (0 if the ring is empty) and setting *data to point to it.  The
+ * chunk remains queued until consumed with mevcli_tx_done().  These
+ * two may be called from interrupt context, but only by one consumer.
+ */
+unsigned int	mevcli_tx_take(mevcli_ctx_t *ctx, const char **data);
+void	mevcli_tx_done(mevcli_ctx_t *ctx, unsigned int len);
+#endif
+
+#if MEVCLI_LOG_BUFLEN > 0
+/* Queue a log message (a line, without line ending) to be shown above
+ * the prompt and line being edited.  This only copies it into the
+ * ring, so it may be called from another task or an interrupt handler
+ * (but only one producer at a time).  If there isn't room, the message
+ * is lost and counted.
+ *
+ * Queued messages are drawn by mevcli_log_flush(), which mevcli_input_*
+ * and mevcli_poll() also call: all of them at once, then the prompt and
+ * line are redrawn.  While a command is running, they wait until it's
+ * finished.
+ */
+void	mevcli_log(mevcli_ctx_t *ctx, const char *msg);
+void	mevcli_log_flush(mevcli_ctx_t *ctx);
+#endif
+
+#if MEVCLI_FEAT_HISTORY_STORE
+/* Attach a persistent history store, and load the history kept in it;
+ * call this just after mevcli_init().  The log is read in one pass, up
+ * to its end or to a damaged record (and in the latter case the store
+ * is rewritten on the next save).  From then on, each command entered
+ * is appended to the store.
+ * Returns the number of entries read, or the read callback's failure.
+ */
+int	mevcli_history_load(mevcli_ctx_t *ctx, const mevcli_hist_store_t *store);
+
+/* Erase the store and write the current history back to it.  This is
+ * done when the log fills up, but can also be called at any time.
+ * Returns 0, or a callback's failure.
+ */
+int	mevcli_history_save(mevcli_ctx_t *ctx);
+#endif
+
+#if MEVCLI_FEAT_HISTORY_COMPRESS
+/* Give a NULL-terminated table of words (e.g. frequent args) which are
+ * stored in history as one byte each, wherever they appear as a whole
+ * word.  Up to 128 commands and words in total are stored this way,
+ * commands first.  Read-only and accessed in place; set it just after
+ * mevcli_init(), as it can't change once there is history.
+ */
+void	mevcli_set_history_dict(mevcli_ctx_t *ctx, const char *const *words);
+#endif
+
 
 ////////////////////////////////////////////////////////////////////////////////
 //									      //
@@ -160,11 +715,159 @@ void	mevcli_input_char(mevcli_ctx_t *ctx, const char in);
 // Internal types
 
 #define MEVCLI_BELL_CHAR	7
+#define MEVCLI_COL_UNKNOWN	(~0U)
+#define MEVCLI_CSI_MAX_PARAMS	2
+#define MEVCLI_TRIE_NONE	0xffff
+
+/* The history store starts with this, followed by records of a 2-byte
+ * length (0xffff where erased, i.e. the end) and 2-byte CRC, both
+ * little-endian, then the line.
+ */
+#define MEVCLI_HIST_MAGIC	"mvh1"
+#define MEVCLI_HIST_MAGIC_LEN	4
+#define MEVCLI_HIST_HDR_LEN	4
+
+/* Bytes from this up in a history entry are tokens (a command, then
+ * dictionary words); the rest is text.
+ */
+#define MEVCLI_HIST_TOKEN	0x80
+
+/* History entries are read through this, a chunk at a time: a run of
+ * stored text, or the word a token stands for.
+ */
+typedef struct {
+	const char *e;		/* The rest of the stored entry */
+	unsigned int left;
+	const char *c;		/* The rest of the current chunk */
+	unsigned int clen;
+} mevcli_hist_rd_t;
+
+/* Escape sequence decoder states */
+#define MEVCLI_ESC_GROUND	0
+#define MEVCLI_ESC_ESC		1
+#define MEVCLI_ESC_CSI		2
+#define MEVCLI_ESC_SS3		3
 
 typedef struct mevcli_ctx {
 	void (*cb_output_char)(char out);
+#if MEVCLI_OUTBUF_LEN > 0
+	void (*cb_output_buf)(const char *out, unsigned int len);
+	unsigned int outbuf_len;
+	char outbuf[MEVCLI_OUTBUF_LEN];
+#endif
+#if MEVCLI_TXRING_LEN > 0
+	void (*cb_tx_kick)(void);
+	void (*cb_tx_highwater)(bool above);
+	/* Free-running producer/consumer counts; the producer (us)
+	 * only writes tx_head, the consumer only writes tx_tail.
+	 */
+	volatile unsigned int tx_head;
+	volatile unsigned int tx_tail;
+	volatile bool tx_above_highwater;
+	/* Bytes discarded because the ring was full */
+	unsigned int tx_dropped;
+	char txring[MEVCLI_TXRING_LEN];
+#endif
+#if MEVCLI_RXRING_LEN > 0
+	void (*cb_rx_flow)(bool stop);
+	/* As for the TX ring, but the interrupt handler is the
+	 * producer writing rx_head, and we're the consumer.
+	 */
+	volatile unsigned int rx_head;
+	volatile unsigned int rx_tail;
+	volatile bool rx_stopped;
+	/* Chars lost because the ring was full */
+	volatile unsigned int rx_overflows;
+	char rxring[MEVCLI_RXRING_LEN];
+#endif
+#if MEVCLI_LOG_BUFLEN > 0
+	/* Log messages, each ended with '\n'; as for the RX ring,
+	 * mevcli_log() is the producer, writing log_head.
+	 */
+	volatile unsigned int log_head;
+	volatile unsigned int log_tail;
+	/* Only ever counted up by mevcli_log(), with how many of those
+	 * have been shown kept separately by mevcli_log_draw().
+	 */
+	volatile unsigned int log_dropped;
+	unsigned int log_dropped_shown;
+	char log_ring[MEVCLI_LOG_BUFLEN];
+#endif
 	const mevcli_cmd_t *commands;
 	unsigned int num_commands;
+#if MEVCLI_FEAT_CMD_INDEX
+	const uint16_t *cmd_index;
+#endif
+#if MEVCLI_TRIE_NODES > 0
+	/* Trie of lowercased command names; node 0 is the root, so
+	 * doubles as "none" for child/sibling links.  trie_cmd gives
+	 * the command whose name ends at a node, or MEVCLI_TRIE_NONE.
+	 * trie_used is 0 if the trie couldn't be built.
+	 */
+	unsigned int trie_used;
+	char trie_char[MEVCLI_TRIE_NODES];
+	uint16_t trie_child[MEVCLI_TRIE_NODES];
+	uint16_t trie_sibling[MEVCLI_TRIE_NODES];
+	uint16_t trie_cmd[MEVCLI_TRIE_NODES];
+#endif
+
+	/* MEVCLI_TERM_CAP_* flags */
+	unsigned int term_caps;
+
+	/* Machine mode; no echo/editing, and numbered status lines */
+	bool machine_mode;
+	char machine_last;
+	bool machine_overflow;
+	unsigned int machine_seq;
+
+	/* True while a command handler is running */
+	bool in_cmd;
+
+	/* The rest of the line's commands still to run, and whether the
+	 * next one should (see mevcli_run_batch()).
+	 */
+	char *batch_next;
+	unsigned int batch_left;
+	char batch_sep;
+	bool batch_run;
+
+#if MEVCLI_FEAT_ASYNC
+	/* A command returned MEVCLI_PENDING; input is kept until it
+	 * completes.
+	 */
+	bool pending;
+	const mevcli_cmd_t *pending_cmd;
+	unsigned int typeahead_len;
+	char typeahead[MEVCLI_TYPEAHEAD_LEN];
+
+	/* The pending command yielded, and is called again (with
+	 * task_argc args) by mevcli_tick().  task_pt is the resume point
+	 * for MEVCLI_PT_*.
+	 */
+	bool yielding;
+	unsigned int task_argc;
+	unsigned int task_pt;
+	uint64_t task_state[(MEVCLI_TASK_STATE_LEN + 7) / 8];
+#endif
+
+#if MEVCLI_FEAT_COMPLETION
+	/* The last input was a tab (so another lists candidates) */
+	bool compl_tab;
+	/* Cached command name candidates: compl_count of them, between
+	 * compl_first and compl_last inclusive in table/index order, for
+	 * the compl_len chars last completed.
+	 */
+	unsigned int compl_len;
+	unsigned int compl_count;
+	unsigned int compl_first;
+	unsigned int compl_last;
+#endif
+
+	/* Column the terminal's cursor is believed to be at (including
+	 * the prompt), or MEVCLI_COL_UNKNOWN.  Used to pick the shortest
+	 * way of moving it.
+	 */
+	unsigned int term_col;
 
 	/* Length of the prompt, for screen drawing purposes;
 	 * note this is dynamic and might be updated by a command!
@@ -181,16 +884,40 @@ typedef struct mevcli_ctx {
 	 */
 	unsigned int cursorpos;
 
-	/* FSM for CSI/escape detection:
-	 *  0 = idle, 1 = got escape, 2 = got [
+	/* Escape sequence decoder state (MEVCLI_ESC_*), and details of
+	 * the sequence being parsed: the char after ESC, numeric
+	 * parameters, and any private marker/intermediate char.
+	 */
+	uint8_t esc_state;
+	char esc_intro;
+	char esc_mark;
+	uint8_t esc_nparams;
+	uint16_t esc_params[MEVCLI_CSI_MAX_PARAMS];
+
+#if MEVCLI_FEAT_BRACKETED_PASTE
+	/* Between ESC[200~ and ESC[201~, input collects here (with
+	 * line breaks as '\r') until the end of the paste:
 	 */
-	unsigned int csi_fsm_state;
+	bool pasting;
+	bool paste_overflow;
+	char paste_last;
+	unsigned int paste_len;
+	char paste_buf[MEVCLI_PASTE_BUFLEN];
+#endif
 
 	/* Line buffer working storage (inc terminator) */
 	char line[MEVCLI_MAX_LINE_LEN + 1];
 
-	/* Storage for argv pointers */
-	char *args[MEVCLI_MAX_ARGS];
+	/* Storage for argv pointers, and arg lengths; the handler's args
+	 * start at arg_base.
+	 */
+	char *args[MEVCLI_MAX_DEPTH + MEVCLI_MAX_ARGS];
+	uint16_t arg_lens[MEVCLI_MAX_DEPTH + MEVCLI_MAX_ARGS];
+	unsigned int arg_base;
+#if MEVCLI_FEAT_TYPED_ARGS
+	/* Converted args, for typedfn */
+	mevcli_arg_t typed_args[MEVCLI_MAX_ARGS];
+#endif
 
 #if MEVCLI_FEAT_HISTORY
 	/* History chars buffer */
@@ -200,22 +927,46 @@ typedef struct mevcli_ctx {
 	char backup_line[MEVCLI_MAX_LINE_LEN + 1];
 	unsigned int backup_linepos;
 
-	/* Length of strings packed back to back from start of history
-	 * buffer, 0 for invalid.
-	 */
-	unsigned int history_strlens[MEVCLI_HISTORY_MAX_STRS];
-
-	/* Highest index of history_strlens with a valid line,
-	 * or -1 for none (saves searching in several places).
+	/* The history buffer is a ring of entries, each stored
+	 * contiguously (without terminator) at hist_off[] for
+	 * hist_len[] bytes.  The index is itself a ring, of hist_num
+	 * entries ending (newest) just below slot hist_head.
 	 */
-	int history_strlens_topvalid;
+	uint16_t hist_off[MEVCLI_HISTORY_MAX_STRS];
+	uint16_t hist_len[MEVCLI_HISTORY_MAX_STRS];
+	unsigned int hist_head;
+	unsigned int hist_num;
+	/* Where the next entry goes, if it fits before the end */
+	unsigned int hist_wr;
+#if MEVCLI_FEAT_HISTORY_COMPRESS
+	const char *const *hist_dict;
+#endif
 
 	/* When navigating up/down through history buffer, this
-	 * gives the current entry.  -1 means we're doing a
+	 * gives the current entry (0 newest).  -1 means we're doing a
 	 * regular line edit and not browsing history.
 	 */
 	int cur_hist_browse_idx;
 #endif
+
+#if MEVCLI_FEAT_HISTORY_STORE
+	const mevcli_hist_store_t *hist_store;
+	/* Where the next record goes (size if it needs rewriting) */
+	unsigned int hist_store_end;
+#endif
+
+#if MEVCLI_HISTORY_SEARCH_LEN > 0
+	/* ^R search: the string, and where it last matched (the
+	 * entry's age and offset), if search_found.
+	 */
+	char search[MEVCLI_HISTORY_SEARCH_LEN];
+	unsigned int search_len;
+	unsigned int search_age;
+	unsigned int search_at;
+	bool searching;
+	bool search_found;
+	bool search_failed;
+#endif
 } mevcli_ctx_t;
 
 
@@ -230,9 +981,108 @@ typedef struct mevcli_ctx {
  * tiny embedded/MCU systems.
  */
 
+/* Pass on anything in the output staging buffer.  If no callback has
+ * been registered yet, the output is kept until there is one.
+ */
+static void	mevcli_flush(mevcli_ctx_t *ctx)
+{
+#if MEVCLI_TXRING_LEN > 0
+	if (ctx->tx_head != ctx->tx_tail && ctx->cb_tx_kick)
+		ctx->cb_tx_kick();
+#elif MEVCLI_OUTBUF_LEN > 0
+	if (ctx->outbuf_len == 0)
+		return;
+
+	if (ctx->cb_output_buf) {
+		ctx->cb_output_buf(ctx->outbuf, ctx->outbuf_len);
+	} else if (ctx->cb_output_char) {
+		for (unsigned int i = 0; i < ctx->outbuf_len; i++)
+			ctx->cb_output_char(ctx->outbuf[i]);
+	} else {
+		return;
+	}
+	ctx->outbuf_len = 0;
+#endif
+}
+
+#if MEVCLI_TXRING_LEN > 0
+/* Queue a char in the TX ring, never waiting for space: if the consumer
+ * hasn't kept up, the char is dropped (and counted).
+ */
+static void	mevcli_tx_put(mevcli_ctx_t *ctx, char c)
+{
+	unsigned int head = ctx->tx_head;
+	unsigned int used = head - ctx->tx_tail;
+
+	if (used >= MEVCLI_TXRING_LEN) {
+		ctx->tx_dropped++;
+		return;
+	}
+	ctx->txring[head & (MEVCLI_TXRING_LEN - 1)] = c;
+	MEVCLI_BARRIER();
+	ctx->tx_head = head + 1;
+
+	if (used + 1 >= MEVCLI_TXRING_HIGHWATER && !ctx->tx_above_highwater) {
+		if (ctx->cb_tx_highwater)
+			ctx->cb_tx_highwater(true);
+		MEVCLI_BARRIER();
+		ctx->tx_above_highwater = true;
+		/* Don't wait for the next flush to get things moving.  The
+		 * consumer owns clearing the flag; it might already have
+		 * drained the ring, but will see the flag on its next
+		 * mevcli_tx_take().
+		 */
+		if (ctx->cb_tx_kick)
+			ctx->cb_tx_kick();
+	}
+}
+#endif
+
 static void	mevcli_putch(mevcli_ctx_t *ctx, char c)
 {
+#if MEVCLI_TXRING_LEN > 0
+	mevcli_tx_put(ctx, c);
+#elif MEVCLI_OUTBUF_LEN > 0
+	if (ctx->outbuf_len == MEVCLI_OUTBUF_LEN) {
+		mevcli_flush(ctx);
+		if (ctx->outbuf_len == MEVCLI_OUTBUF_LEN)
+			return;		/* Nowhere to put it */
+	}
+	ctx->outbuf[ctx->outbuf_len++] = c;
+#else
 	ctx->cb_output_char(c);
+#endif
+}
+
+/* Output len chars (not necessarily terminated), e.g. a span of the
+ * line buffer.  When buffering, this copies in chunks rather than
+ * going char by char.
+ */
+static void	mevcli_putbuf(mevcli_ctx_t *ctx, const char *buf, unsigned int len)
+{
+#if MEVCLI_TXRING_LEN > 0
+	for (unsigned int i = 0; i < len; i++)
+		mevcli_tx_put(ctx, buf[i]);
+#elif MEVCLI_OUTBUF_LEN > 0
+	while (len > 0) {
+		if (ctx->outbuf_len == MEVCLI_OUTBUF_LEN) {
+			mevcli_flush(ctx);
+			if (ctx->outbuf_len == MEVCLI_OUTBUF_LEN)
+				return;
+		}
+		unsigned int space = MEVCLI_OUTBUF_LEN - ctx->outbuf_len;
+		unsigned int chunk = len < space ? len : space;
+
+		for (unsigned int i = 0; i < chunk; i++)
+			ctx->outbuf[ctx->outbuf_len + i] = buf[i];
+		ctx->outbuf_len += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+#else
+	for (unsigned int i = 0; i < len; i++)
+		ctx->cb_output_char(buf[i]);
+#endif
 }
 
 static unsigned int	mevcli_putstr(mevcli_ctx_t *ctx, const char *str)
@@ -248,11 +1098,14 @@ static unsigned int	mevcli_putstr(mevcli_ctx_t *ctx, const char *str)
 static void	mevcli_newl(mevcli_ctx_t *ctx)
 {
 	mevcli_putstr(ctx, "\r\n");
+	ctx->term_col = 0;
 }
 
+/* Note this assumes the prompt starts at column 0 */
 static void	mevcli_prompt(mevcli_ctx_t *ctx)
 {
 	ctx->prompt_len = mevcli_putstr(ctx, MEVCLI_PROMPT);
+	ctx->term_col = ctx->prompt_len;
 }
 
 static void	mevcli_ansi_eraseline(mevcli_ctx_t *ctx)
@@ -262,130 +1115,362 @@ static void	mevcli_ansi_eraseline(mevcli_ctx_t *ctx)
 
 static void	mevcli_ansi_eraseright(mevcli_ctx_t *ctx)
 {
-	mevcli_putstr(ctx, "\e[0K");
+	mevcli_putstr(ctx, "\e[K");
 }
 
-static void	mevcli_ansi_cursorpos(mevcli_ctx_t *ctx, unsigned int x)
+static void	mevcli_pad(mevcli_ctx_t *ctx, char c, unsigned int n)
 {
-	if (x > 999)
-		return;		/* SORRY */
-
-	if (x == 0) {		/* Shortcut for common case */
-		mevcli_putch(ctx, '\r');
-		return;
-	}
-
-	x++;	/* Irritatingly, terminal columns are 1-indexed */
+	for ( ; n > 0; n--)
+		mevcli_putch(ctx, c);
+}
 
-	mevcli_putstr(ctx, "\e[");
-	/* Some hacky decimal=print formatting, avoiding printf */
-	char digits[3];
+/* Some hacky number formatting, avoiding printf: x in the given base
+ * (up to 16; upper case if 'upper'), preceded by '-' if 'neg', and
+ * right-justified to width with pad chars.  With zero padding, the
+ * sign goes before the padding.
+ */
+static void	mevcli_putnum(mevcli_ctx_t *ctx, unsigned int x, unsigned int base,
+			      bool upper, bool neg, unsigned int width, char pad)
+{
+	char digits[sizeof(unsigned int) * 8];
 	unsigned int numdig = 0;
-	for ( ; numdig < 3; numdig++) {
-		digits[numdig] = x % 10;
-		x /= 10;
-		if (x == 0)
-			break;
-	}
-	for (int i = numdig; i >= 0; i--) {
-		mevcli_putch(ctx, '0' + digits[i]);
+	do {
+		digits[numdig++] = x % base;
+		x /= base;
+	} while (x != 0);
+
+	unsigned int len = numdig + neg;
+	if (neg && pad == '0')
+		mevcli_putch(ctx, '-');
+	if (width > len)
+		mevcli_pad(ctx, pad, width - len);
+	if (neg && pad != '0')
+		mevcli_putch(ctx, '-');
+	while (numdig > 0) {
+		char d = digits[--numdig];
+		mevcli_putch(ctx, d < 10 ? '0' + d : (upper ? 'A' : 'a') + d - 10);
 	}
-	mevcli_putch(ctx, 'G');
 }
 
+/* Number of digits mevcli_putnum() would output for x */
+static unsigned int	mevcli_putnum_len(unsigned int x, unsigned int base)
+{
+	unsigned int len = 1;
+	for ( ; x >= base; x /= base)
+		len++;
+	return len;
+}
 
-///////////////////////// History management ///////////////////////////////////
-
-static int	mevcli_strlen(const char *str)
+static void	mevcli_putdec(mevcli_ctx_t *ctx, unsigned int x)
 {
-	int l = 0;
-	while (*str) { str++; l++; }
-	return l;
+	mevcli_putnum(ctx, x, 10, false, false, 0, ' ');
 }
 
-/* Add the given commandline to history (i.e. push to most recent).
+/* Output a CSI sequence with one numeric parameter, ESC [ n <final>.
+ * A parameter of 1 is the default, so is left out.
+ */
+static void	mevcli_ansi_csi(mevcli_ctx_t *ctx, unsigned int n, char final)
+{
+	mevcli_putstr(ctx, "\e[");
+	if (n != 1)
+		mevcli_putdec(ctx, n);
+	mevcli_putch(ctx, final);
+}
+
+/* Number of bytes mevcli_ansi_csi() would output for n */
+static unsigned int	mevcli_ansi_csi_len(unsigned int n)
+{
+	return n == 1 ? 3 : 2 + mevcli_putnum_len(n, 10) + 1;
+}
+
+/* Move the cursor to column x, using the shortest sequence from where
+ * the cursor is believed to be (ctx->term_col):
  *
- * This shuffles memory around; performance isn't a concern, but using
- * memory efficiently _is_.
+ * - Absolute: CR for column 0, else CHA, or CR then cursor-forward
+ * - Left: a run of backspaces, or cursor-back (CUB)
+ * - Right: cursor-forward (CUF), or just re-output the line chars
+ *   being moved over
  *
- * The ctx->history buffer contains a sequence of ctx->histlen
- * zero-terminated strings back to back from byte 0 up; ctx->histlen
- * lists the lengths including terminator (from newest to oldest).
+ * The last requires that the line buffer matches what's on screen
+ * between the old and new positions, which callers ensure by only
+ * moving rightwards over unedited chars.
  */
-static void	mevcli_history_append(mevcli_ctx_t *ctx, const char *last_cmd)
+static void	mevcli_ansi_cursorpos(mevcli_ctx_t *ctx, unsigned int x)
 {
-#if MEVCLI_FEAT_HISTORY
-	int len = mevcli_strlen(last_cmd) + 1;
+	unsigned int from = ctx->term_col;
+	unsigned int best, cost;
+	char how;
 
-	/* The history buffer is newest lowest.	 So, we're going to
-	 * copy all existing lines upwards to make space for the
-	 * newest at the start.	 Count total lengths; if remainder is
-	 * too small we'll have to drop one or more to make room.
-	 *
-	 * FIXME: The buffer currently contains terminated strings.
-	 * However, since we also keep a running count of the length
-	 * of all valid strings in history_strlens, we could do away
-	 * with the terminators.
-	 */
+	if (x == 0) {
+		how = '\r';
+		best = 1;
+	} else {
+		/* Irritatingly, terminal columns are 1-indexed */
+		how = 'G';
+		best = mevcli_ansi_csi_len(x + 1);
+		cost = 1 + mevcli_ansi_csi_len(x);
+		if (cost < best) {
+			how = '\r';
+			best = cost;
+		}
+	}
 
-	int total_histlen = 0;
-	int highest_copyable = -1;
-	int highest_copyable_starts_at = 0;
-	for (int i = 0; i < MEVCLI_HISTORY_MAX_STRS; i++) {
-		if (ctx->history_strlens[i] == 0)
-			break;
-		int new_total_histlen = total_histlen + ctx->history_strlens[i];
-		if (((int)MEVCLI_HISTORY_BUFLEN - new_total_histlen) >= len) {
-			highest_copyable = i;
-			highest_copyable_starts_at = total_histlen;
+	if (from == x) {
+		return;
+	} else if (from == MEVCLI_COL_UNKNOWN) {
+		/* Absolute it is */
+	} else if (x < from) {
+		unsigned int n = from - x;
+		if (n < best) {
+			how = '\b';
+			best = n;
+		}
+		cost = mevcli_ansi_csi_len(n);
+		if (cost < best) {
+			how = 'D';
+			best = cost;
+		}
+	} else {
+		unsigned int n = x - from;
+		cost = mevcli_ansi_csi_len(n);
+		if (cost < best) {
+			how = 'C';
+			best = cost;
+		}
+		if (n < best && from >= ctx->prompt_len &&
+		    x <= ctx->prompt_len + ctx->linepos) {
+			how = 'p';
 		}
-		total_histlen = new_total_histlen;
 	}
 
-	if (highest_copyable >= 0) {
-		/* If valid, highest_copyable gives the oldest history
-		 * string that'll be copied.  Starting there, and
-		 * heading downwards, copy strings upwards by 'len'
-		 * bytes:
-		 */
-		int start = highest_copyable_starts_at;
+	switch (how) {
+	case '\r':
+		mevcli_putch(ctx, '\r');
+		if (x > 0)
+			mevcli_ansi_csi(ctx, x, 'C');
+		break;
+	case '\b':
+		for (unsigned int i = x; i < from; i++)
+			mevcli_putch(ctx, '\b');
+		break;
+	case 'p':
+		mevcli_putbuf(ctx, &ctx->line[from - ctx->prompt_len], x - from);
+		break;
+	case 'C':
+		mevcli_ansi_csi(ctx, x - from, 'C');
+		break;
+	case 'D':
+		mevcli_ansi_csi(ctx, from - x, 'D');
+		break;
+	default:
+		mevcli_ansi_csi(ctx, x + 1, 'G');
+	}
+	ctx->term_col = x;
+}
 
-		for (int i = highest_copyable; i >= 0; i--) {
-			unsigned int clen = ctx->history_strlens[i];
 
-			for (int j = clen - 1; j >= 0; j--) {
-				ctx->history[start + len + j] = ctx->history[start + j];
-			}
-			if (i > 0)
-				start -= ctx->history_strlens[i - 1];
+///////////////////////// History management ///////////////////////////////////
+
+static int	mevcli_strlen(const char *str)
+{
+	int l = 0;
+	while (*str) { str++; l++; }
+	return l;
+}
+
+#if MEVCLI_FEAT_HISTORY
+/* Index slot of the entry age entries older than the newest */
+static unsigned int	mevcli_history_slot(mevcli_ctx_t *ctx, unsigned int age)
+{
+	unsigned int slot = ctx->hist_head + MEVCLI_HISTORY_MAX_STRS - 1 - age;
+	if (slot >= MEVCLI_HISTORY_MAX_STRS)
+		slot -= MEVCLI_HISTORY_MAX_STRS;
+	return slot;
+}
+
+static const char	*mevcli_history_entry(mevcli_ctx_t *ctx, unsigned int age,
+					      unsigned int *len)
+{
+	unsigned int slot = mevcli_history_slot(ctx, age);
+
+	*len = ctx->hist_len[slot];
+	return &ctx->history[ctx->hist_off[slot]];
+}
+
+#if MEVCLI_FEAT_HISTORY_COMPRESS
+static const char	*mevcli_history_token(mevcli_ctx_t *ctx, uint8_t t)
+{
+	unsigned int i = t - MEVCLI_HIST_TOKEN;
+
+	if (i < ctx->num_commands)
+		return ctx->commands[i].name;
+	return ctx->hist_dict[i - ctx->num_commands];
+}
+
+static bool	mevcli_word_is(const char *w, unsigned int len, const char *s)
+{
+	for (unsigned int i = 0; i < len; i++) {
+		if (s[i] != w[i])
+			return false;
+	}
+	return s[len] == '\0';
+}
+
+/* The token for a word (the command, if first), or 0 */
+static uint8_t	mevcli_history_find_token(mevcli_ctx_t *ctx, const char *w,
+					  unsigned int len, bool first)
+{
+	unsigned int t = MEVCLI_HIST_TOKEN;
+
+	for (unsigned int i = 0; first && i < ctx->num_commands && t + i <= 0xff; i++) {
+		if (mevcli_word_is(w, len, ctx->commands[i].name))
+			return t + i;
+	}
+	t += ctx->num_commands;
+	for (unsigned int i = 0; ctx->hist_dict && ctx->hist_dict[i] && t <= 0xff; i++, t++) {
+		if (mevcli_word_is(w, len, ctx->hist_dict[i]))
+			return t;
+	}
+	return 0;
+}
 
-			if (i < (MEVCLI_HISTORY_MAX_STRS - 1)) {
-				ctx->history_strlens[i + 1] = clen;
+/* Encode a line for history, into dest if given; returns the length.
+ * Whole words (between spaces) are replaced by their tokens, if any,
+ * so it expands back to exactly the same text.
+ */
+static unsigned int	mevcli_history_encode(mevcli_ctx_t *ctx, const char *line,
+					      unsigned int len, char *dest)
+{
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < len; n++) {
+		if (line[i] != ' ' && (i == 0 || line[i - 1] == ' ')) {
+			unsigned int wl = 1;
+			while (i + wl < len && line[i + wl] != ' ')
+				wl++;
+
+			uint8_t t = wl > 1 ? mevcli_history_find_token(ctx, &line[i], wl, i == 0) : 0;
+			if (t) {
+				if (dest)
+					dest[n] = t;
+				i += wl;
+				continue;
 			}
-			/* else, if on the oldest possible string getting older,
-			 * it gets lost.
-			 */
 		}
-		ctx->history_strlens_topvalid = highest_copyable <
-			(MEVCLI_HISTORY_MAX_STRS - 1) ?
-			highest_copyable + 1 :
-			highest_copyable;
-	} else {
-		ctx->history_strlens_topvalid = 0;
+		if (dest)
+			dest[n] = line[i];
+		i++;
 	}
-	if (highest_copyable < (MEVCLI_HISTORY_MAX_STRS - 2)) {
-		/* We had more indices spare than bytes to store large strings;
-		 * terminate the list of indices.  NOTE: this also works if
-		 * no history copy-up occurred (i.e. highest_copyable = -1)
-		 */
-		ctx->history_strlens[highest_copyable + 2] = 0;
+	return n;
+}
+#endif
+
+static void	mevcli_history_open(mevcli_ctx_t *ctx, mevcli_hist_rd_t *rd, unsigned int age)
+{
+	rd->e = mevcli_history_entry(ctx, age, &rd->left);
+	rd->clen = 0;
+}
+
+/* Move on to the next chunk; false at the end of the entry */
+static bool	mevcli_history_chunk(mevcli_ctx_t *ctx, mevcli_hist_rd_t *rd)
+{
+	unsigned int n = 0;
+
+	if (rd->left == 0)
+		return false;
+#if MEVCLI_FEAT_HISTORY_COMPRESS
+	if ((uint8_t)*rd->e >= MEVCLI_HIST_TOKEN) {
+		rd->c = mevcli_history_token(ctx, *rd->e);
+		rd->clen = mevcli_strlen(rd->c);
+		rd->e++;
+		rd->left--;
+		return true;
+	}
+	while (n < rd->left && (uint8_t)rd->e[n] < MEVCLI_HIST_TOKEN)
+		n++;
+#else
+	n = rd->left;
+#endif
+	rd->c = rd->e;
+	rd->clen = n;
+	rd->e += n;
+	rd->left -= n;
+	return true;
+}
+
+/* The next char of the entry, or -1 at the end */
+static int	mevcli_history_getc(mevcli_ctx_t *ctx, mevcli_hist_rd_t *rd)
+{
+	while (rd->clen == 0) {
+		if (!mevcli_history_chunk(ctx, rd))
+			return -1;
 	}
+	rd->clen--;
+	return *rd->c++;
+}
+
+#if MEVCLI_FEAT_HISTORY_STORE
+/* Length of the entry's text */
+static unsigned int	mevcli_history_text_len(mevcli_ctx_t *ctx, unsigned int age)
+{
+	mevcli_hist_rd_t rd;
+	unsigned int len = 0;
+
+	mevcli_history_open(ctx, &rd, age);
+	while (mevcli_history_chunk(ctx, &rd))
+		len += rd.clen;
+	return len;
+}
+#endif
+#endif
+
+/* Add the given commandline to history (i.e. push to most recent).
+ *
+ * Entries are never split across the end of the buffer, so they can
+ * be read in place; if the new one doesn't fit before the end it
+ * goes at the start, and the tail is wasted until the next lap.  The
+ * oldest entries are then dropped until the new one no longer
+ * overlaps them.
+ */
+static void	mevcli_history_append(mevcli_ctx_t *ctx, const char *last_cmd,
+				      unsigned int len)
+{
+#if MEVCLI_FEAT_HISTORY
+	unsigned int wr = ctx->hist_wr;
+	unsigned int pos = wr;
+
+#if MEVCLI_FEAT_HISTORY_COMPRESS
+	unsigned int textlen = len;
+	len = mevcli_history_encode(ctx, last_cmd, textlen, 0);
+#endif
+	if (len > MEVCLI_HISTORY_BUFLEN)
+		len = MEVCLI_HISTORY_BUFLEN;
+	if (pos + len > MEVCLI_HISTORY_BUFLEN)
+		pos = 0;
+
+	while (ctx->hist_num > 0) {
+		unsigned int o = ctx->hist_off[mevcli_history_slot(ctx, ctx->hist_num - 1)];
+		bool overlaps = (pos == wr) ? (o >= wr && o < wr + len) :
+			(o >= wr || o < len);
 
-	/* Finally, copy the new string in: */
-	for (int i = 0; i < len; i++) {
-		ctx->history[i] = last_cmd[i];
+		if (!overlaps && ctx->hist_num < MEVCLI_HISTORY_MAX_STRS)
+			break;
+		ctx->hist_num--;	/* Drop the oldest */
 	}
-	ctx->history_strlens[0] = len;
+
+#if MEVCLI_FEAT_HISTORY_COMPRESS
+	mevcli_history_encode(ctx, last_cmd, textlen, &ctx->history[pos]);
+#else
+	for (unsigned int i = 0; i < len; i++)
+		ctx->history[pos + i] = last_cmd[i];
+#endif
+
+	ctx->hist_off[ctx->hist_head] = pos;
+	ctx->hist_len[ctx->hist_head] = len;
+	if (++ctx->hist_head == MEVCLI_HISTORY_MAX_STRS)
+		ctx->hist_head = 0;
+	ctx->hist_num++;
+	ctx->hist_wr = pos + len;
 
 	/* Convenient to do this here: a command was entered, so treat
 	 * history-browsing as done:
@@ -394,19 +1479,110 @@ static void	mevcli_history_append(mevcli_ctx_t *ctx, const char *last_cmd)
 #endif
 }
 
+#if MEVCLI_FEAT_HISTORY_STORE
+/* CRC-16/CCITT, bitwise to stay small */
+static uint16_t	mevcli_crc16(uint16_t crc, const char *buf, unsigned int len)
+{
+	for (unsigned int i = 0; i < len; i++) {
+		crc ^= (uint8_t)buf[i] << 8;
+		for (int b = 0; b < 8; b++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+/* Write the record for the entry of the given age at offset */
+static int	mevcli_history_store_write(mevcli_ctx_t *ctx, unsigned int offset,
+					   unsigned int age, unsigned int len)
+{
+	const mevcli_hist_store_t *store = ctx->hist_store;
+	char hdr[MEVCLI_HIST_HDR_LEN];
+	mevcli_hist_rd_t rd;
+
+	hdr[0] = len;
+	hdr[1] = len >> 8;
+	uint16_t crc = mevcli_crc16(0xffff, hdr, 2);
+	mevcli_history_open(ctx, &rd, age);
+	while (mevcli_history_chunk(ctx, &rd))
+		crc = mevcli_crc16(crc, rd.c, rd.clen);
+	hdr[2] = crc;
+	hdr[3] = crc >> 8;
+
+	/* The text goes as it's expanded (so a store stays valid if
+	 * the commands change)
+	 */
+	int r = store->write(store->opaque, offset, hdr, MEVCLI_HIST_HDR_LEN);
+	offset += MEVCLI_HIST_HDR_LEN;
+	mevcli_history_open(ctx, &rd, age);
+	while (r == 0 && mevcli_history_chunk(ctx, &rd)) {
+		r = store->write(store->opaque, offset, rd.c, rd.clen);
+		offset += rd.clen;
+	}
+	return r;
+}
+
+/* Append the newest entry to the store, or rewrite it if full */
+static void	mevcli_history_store_append(mevcli_ctx_t *ctx)
+{
+	if (!ctx->hist_store || ctx->hist_num == 0)
+		return;
+
+	unsigned int len = mevcli_history_text_len(ctx, 0);
+	unsigned int end = ctx->hist_store_end;
+
+	if (end + MEVCLI_HIST_HDR_LEN + len > ctx->hist_store->size) {
+		mevcli_history_save(ctx);
+	} else if (mevcli_history_store_write(ctx, end, 0, len) == 0) {
+		ctx->hist_store_end = end + MEVCLI_HIST_HDR_LEN + len;
+	} else {
+		/* Don't know what's there now */
+		ctx->hist_store_end = ctx->hist_store->size;
+	}
+}
+#endif
 
 ///////////////////////// Command execution ////////////////////////////////////
 
-static void	mevcli_help(mevcli_ctx_t *ctx, const char *why)
+/* The table of commands below parent, or the top level if it's NULL */
+static const mevcli_cmd_t	*mevcli_level(mevcli_ctx_t *ctx, const mevcli_cmd_t *parent,
+					      unsigned int *num)
+{
+	if (parent) {
+		*num = parent->num_subcmds;
+		return parent->subcmds;
+	}
+	*num = ctx->num_commands;
+	return ctx->commands;
+}
+
+/* Help for cmd, prefixed by the depth names of the commands above it */
+static void	mevcli_help_line(mevcli_ctx_t *ctx, const mevcli_cmd_t **path,
+				 unsigned int depth, const mevcli_cmd_t *cmd)
+{
+	mevcli_putch(ctx, '\t');
+	for (unsigned int i = 0; i < depth; i++) {
+		mevcli_putstr(ctx, path[i]->name);
+		mevcli_putch(ctx, ' ');
+	}
+	mevcli_putstr(ctx, cmd->name);
+	mevcli_putstr(ctx, cmd->help);
+	mevcli_newl(ctx);
+}
+
+/* Help for the commands at the level below path[depth - 1] (or the top
+ * level, for depth 0).
+ */
+static void	mevcli_help(mevcli_ctx_t *ctx, const char *why,
+			    const mevcli_cmd_t **path, unsigned int depth)
 {
+	unsigned int num;
+	const mevcli_cmd_t *cmds = mevcli_level(ctx, depth ? path[depth - 1] : 0, &num);
+
 	mevcli_newl(ctx);
 	mevcli_putstr(ctx, why);
 	mevcli_putstr(ctx, ".  Commands are:\r\n\r\n");
-	for (unsigned int cmd = 0; cmd < ctx->num_commands; cmd++) {
-		mevcli_putch(ctx, '\t');
-		mevcli_putstr(ctx, ctx->commands[cmd].name);
-		mevcli_putstr(ctx, ctx->commands[cmd].help);
-		mevcli_newl(ctx);
+	for (unsigned int cmd = 0; cmd < num; cmd++) {
+		mevcli_help_line(ctx, path, depth, &cmds[cmd]);
 	}
 	mevcli_newl(ctx);
 #ifdef MEVCLI_EXTRA_HELPSTRING
@@ -434,491 +1610,2245 @@ static bool	mevcli_str_match(char *needle, const char *haystack)
 	return !*needle && !*haystack;
 }
 
-/* Having got an entered line, do two things:
- * 1) Match the first word into a command string
- * 2) Create an argv array of the remainder of the line chopped at whitespace
- *    boundaries, up to MEVCLI_MAX_ARGS
- */
-static void	mevcli_process_cmd(mevcli_ctx_t *ctx)
+#if MEVCLI_FEAT_COMPLETION || MEVCLI_TRIE_NODES > 0
+/* Case-insensitive: does name start with the len chars of word? */
+static bool	mevcli_prefix_match(const char *word, unsigned int len, const char *name)
 {
-	/* Terminate input line */
-	ctx->line[ctx->linepos] = '\0';
-
-	mevcli_newl(ctx);
-
-	int command_idx = -1;
-	/* Skip past any spaces that might be at the start of the
-	 * line, to find the command:
-	 */
-	for (unsigned int i = 0; i < ctx->linepos; i++) {
-		if (ctx->line[i] > ' ') {
-			command_idx = i;
-			break;
-		}
+	for (unsigned int i = 0; i < len; i++) {
+		if (mevcli_lowercase_alpha(word[i]) != mevcli_lowercase_alpha(name[i]))
+			return false;
 	}
-	/* No actual command on the line! */
-	if (command_idx == -1)
-		goto out;
-
-	char *command = &ctx->line[command_idx];
+	return true;
+}
+#endif
 
-	mevcli_history_append(ctx, command);
+#if MEVCLI_FEAT_CMD_INDEX
+/* A case-insensitive string comparison, giving <0, 0 or >0 as a sorts
+ * before, the same as, or after b.
+ */
+static int	mevcli_str_cmp(const char *a, const char *b)
+{
+	while (*a && mevcli_lowercase_alpha(*a) == mevcli_lowercase_alpha(*b)) {
+		a++;
+		b++;
+	}
+	return (int)(unsigned char)mevcli_lowercase_alpha(*a) -
+		(int)(unsigned char)mevcli_lowercase_alpha(*b);
+}
+#endif
 
-	/* Plonk terminators between each word: */
-	int aftercmd_idx = -1;
-	for (unsigned int i = command_idx; i < ctx->linepos; i++) {
-		if (ctx->line[i] <= ' ') {
-			ctx->line[i] = '\0';
-			/* Make note of first gap after command */
-			if (aftercmd_idx == -1)
-				aftercmd_idx = i;
+#if MEVCLI_TRIE_NODES > 0
+/* Add a command name to the trie; returns false if out of nodes */
+static bool	mevcli_trie_add(mevcli_ctx_t *ctx, const char *name, uint16_t cmd)
+{
+	unsigned int node = 0;
+
+	for ( ; *name; name++) {
+		char c = mevcli_lowercase_alpha(*name);
+		unsigned int n = ctx->trie_child[node];
+
+		while (n != 0 && ctx->trie_char[n] != c)
+			n = ctx->trie_sibling[n];
+
+		if (n == 0) {
+			if (ctx->trie_used >= MEVCLI_TRIE_NODES)
+				return false;
+			n = ctx->trie_used++;
+			ctx->trie_char[n] = c;
+			ctx->trie_child[n] = 0;
+			ctx->trie_cmd[n] = MEVCLI_TRIE_NONE;
+			ctx->trie_sibling[n] = ctx->trie_child[node];
+			ctx->trie_child[node] = n;
 		}
+		node = n;
 	}
+	/* On duplicates, the first in the table wins */
+	if (ctx->trie_cmd[node] == MEVCLI_TRIE_NONE)
+		ctx->trie_cmd[node] = cmd;
+	return true;
+}
+
+static void	mevcli_trie_build(mevcli_ctx_t *ctx)
+{
+	ctx->trie_used = 1;
+	ctx->trie_child[0] = 0;
+	ctx->trie_sibling[0] = 0;
+	ctx->trie_cmd[0] = MEVCLI_TRIE_NONE;
 
-	unsigned int gotcmd = ~0;
 	for (unsigned int c = 0; c < ctx->num_commands; c++) {
-		/* FIXME: Where a match is short, but unambiguous, match anyway
-		 * for convenience.
-		 */
-		if (mevcli_str_match(command, ctx->commands[c].name)) {
-			gotcmd = c;
-			break;
+		if (!mevcli_trie_add(ctx, ctx->commands[c].name, c)) {
+			/* MEVCLI_TRIE_NODES is too small.  Fall back to
+			 * exact-match lookup without the trie.
+			 */
+			MEVCLI_ASSERT(0);
+			ctx->trie_used = 0;
+			return;
 		}
 	}
-	if (gotcmd == ~0) {
-		mevcli_help(ctx, "Unknown command");
-		goto out;
-	}
-	const mevcli_cmd_t *cmd = &ctx->commands[gotcmd];
-
-	/* Finally, construct argv */
-	unsigned int argc = 0;
-	if (aftercmd_idx != -1) {
-		/* There was text after the command, find args */
-		for (unsigned int i = aftercmd_idx; i < ctx->linepos; i++) {
-			if (ctx->line[i] != '\0') {
-				ctx->args[argc] = &ctx->line[i];
-				argc++;
+}
 
-				if (argc >= MEVCLI_MAX_ARGS)
-					break;
+/* Follow name (case-insensitively) down the trie, returning the node
+ * reached, or 0 if nothing starts with name.
+ */
+static unsigned int	mevcli_trie_walk(mevcli_ctx_t *ctx, const char *name)
+{
+	unsigned int node = 0;
 
-				/* Skip over arg */
-				for ( ; i < ctx->linepos; i++) {
-					if (ctx->line[i] == '\0')
-						break;
-				}
-			}
-		}
-	}
+	for ( ; *name; name++) {
+		char c = mevcli_lowercase_alpha(*name);
 
-	if ((cmd->nargs != -1) && (cmd->nargs != argc)) {
-		mevcli_help(ctx, "Command args are incorrect");
-		goto out;
+		node = ctx->trie_child[node];
+		while (node != 0 && ctx->trie_char[node] != c)
+			node = ctx->trie_sibling[node];
+		if (node == 0)
+			return 0;
 	}
+	return node;
+}
 
-	cmd->cmdfn(cmd->opaque, argc, ctx->args);
+/* Given the node for a typed name, return an exact match if there is
+ * one, else the one command below it if it's unambiguous, else
+ * MEVCLI_ERR_AMBIGUOUS.  Descending a chain of single children costs
+ * no more than the length of the rest of the name.
+ */
+static int	mevcli_trie_resolve(mevcli_ctx_t *ctx, unsigned int node)
+{
+	/* An exact match wins, even if other names continue from it */
+	if (ctx->trie_cmd[node] != MEVCLI_TRIE_NONE)
+		return ctx->trie_cmd[node];
+
+	/* Otherwise, there must be a single chain down to one name */
+	do {
+		node = ctx->trie_child[node];
+		if (node == 0 || ctx->trie_sibling[node] != 0)
+			return MEVCLI_ERR_AMBIGUOUS;
+	} while (ctx->trie_cmd[node] == MEVCLI_TRIE_NONE);
+
+	return ctx->trie_child[node] == 0 ?
+		ctx->trie_cmd[node] : MEVCLI_ERR_AMBIGUOUS;
+}
 
-out:
-	ctx->cursorpos = ctx->linepos = 0;
-	mevcli_prompt(ctx);
+/* Print help for all commands below a trie node */
+static void	mevcli_trie_list(mevcli_ctx_t *ctx, unsigned int node)
+{
+	if (ctx->trie_cmd[node] != MEVCLI_TRIE_NONE)
+		mevcli_help_line(ctx, 0, 0, &ctx->commands[ctx->trie_cmd[node]]);
+	for (node = ctx->trie_child[node]; node != 0; node = ctx->trie_sibling[node])
+		mevcli_trie_list(ctx, node);
 }
+#endif
 
+/* Find name in a table of num commands, by binary search if there's an
+ * index, else linearly, returning its position in the table or
+ * MEVCLI_ERR_UNKNOWN.  As with the trie, an exact match wins, then
+ * (when configured with the trie) an unambiguous prefix of a name,
+ * else MEVCLI_ERR_AMBIGUOUS.
+ */
+static int	mevcli_find_in(const mevcli_cmd_t *cmds, unsigned int num,
+			       const uint16_t *index, char *name)
+{
+#if MEVCLI_FEAT_CMD_INDEX
+	if (index) {
+		unsigned int lo = 0;
+		unsigned int hi = num;
+
+		/* Find the first name not before this one */
+		while (lo < hi) {
+			unsigned int mid = (lo + hi) / 2;
+
+			if (mevcli_str_cmp(cmds[index[mid]].name, name) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == num)
+			return MEVCLI_ERR_UNKNOWN;
+		if (mevcli_str_match(name, cmds[index[lo]].name))
+			return index[lo];
+#if MEVCLI_TRIE_NODES > 0
+		/* Names starting with this one follow it in order */
+		unsigned int len = mevcli_strlen(name);
+
+		if (mevcli_prefix_match(name, len, cmds[index[lo]].name)) {
+			if (lo + 1 < num &&
+			    mevcli_prefix_match(name, len, cmds[index[lo + 1]].name))
+				return MEVCLI_ERR_AMBIGUOUS;
+			return index[lo];
+		}
+#endif
+		return MEVCLI_ERR_UNKNOWN;
+	}
+#else
+	(void)index;
+#endif
+	int found = MEVCLI_ERR_UNKNOWN;
+#if MEVCLI_TRIE_NODES > 0
+	unsigned int len = mevcli_strlen(name);
+#endif
 
-///////////////////////// Cursor movement //////////////////////////////////////
+	for (unsigned int c = 0; c < num; c++) {
+		if (mevcli_str_match(name, cmds[c].name))
+			return c;
+#if MEVCLI_TRIE_NODES > 0
+		if (mevcli_prefix_match(name, len, cmds[c].name))
+			found = (found == MEVCLI_ERR_UNKNOWN) ? (int)c : MEVCLI_ERR_AMBIGUOUS;
+#endif
+	}
+	return found;
+}
 
-static void	mevcli_line_redraw(mevcli_ctx_t *ctx)
+/* Find the named command in the level below parent (or at the top
+ * level, if NULL), returning its index in that table or an error as
+ * above.  The top level uses the trie if there is one.
+ */
+static int	mevcli_find_cmd(mevcli_ctx_t *ctx, const mevcli_cmd_t *parent, char *name)
 {
-	mevcli_ansi_cursorpos(ctx, ctx->prompt_len);
-	mevcli_ansi_eraseright(ctx);
-	for (unsigned int i = 0; i < ctx->linepos; i++) {
-		mevcli_putch(ctx, ctx->line[i]);
+	if (parent)
+		return mevcli_find_in(parent->subcmds, parent->num_subcmds,
+				      parent->subcmd_index, name);
+#if MEVCLI_TRIE_NODES > 0
+	if (ctx->trie_used) {
+		unsigned int node = mevcli_trie_walk(ctx, name);
+
+		if (node == 0)
+			return MEVCLI_ERR_UNKNOWN;
+		return mevcli_trie_resolve(ctx, node);
 	}
-	mevcli_ansi_cursorpos(ctx, ctx->prompt_len + ctx->cursorpos);
+#endif
+#if MEVCLI_FEAT_CMD_INDEX
+	return mevcli_find_in(ctx->commands, ctx->num_commands, ctx->cmd_index, name);
+#else
+	return mevcli_find_in(ctx->commands, ctx->num_commands, 0, name);
+#endif
 }
 
-static void	mevcli_cpy(char *dest, char *src, unsigned int len)
+/* Bitmap of chars needing more than copying when splitting the line
+ * into args: control chars, delimiters, quotes and backslash (and ;
+ * and & with MEVCLI_FEAT_BATCH).  It's built at compile time, so the
+ * (up to 8) chars of MEVCLI_DELIMS are picked out of the string here.
+ */
+typedef char mevcli_delims_check[sizeof(MEVCLI_DELIMS) <= 9 ? 1 : -1];
+
+#define MEVCLI_DELIM_AT(i, c)	(sizeof(MEVCLI_DELIMS) > (i) + 1 && \
+				 MEVCLI_DELIMS[(i) < sizeof(MEVCLI_DELIMS) ? (i) : 0] == (c))
+#define MEVCLI_IS_DELIM(c)	(MEVCLI_DELIM_AT(0, c) || MEVCLI_DELIM_AT(1, c) || \
+				 MEVCLI_DELIM_AT(2, c) || MEVCLI_DELIM_AT(3, c) || \
+				 MEVCLI_DELIM_AT(4, c) || MEVCLI_DELIM_AT(5, c) || \
+				 MEVCLI_DELIM_AT(6, c) || MEVCLI_DELIM_AT(7, c))
+#if MEVCLI_FEAT_BATCH
+#define MEVCLI_IS_BATCH(c)	((c) == ';' || (c) == '&')
+#else
+#define MEVCLI_IS_BATCH(c)	0
+#endif
+#define MEVCLI_TOK_SPECIAL(c)	((c) <= ' ' || (c) == '"' || (c) == '\'' || (c) == '\\' || \
+				 MEVCLI_IS_DELIM(c) || MEVCLI_IS_BATCH(c))
+#define MEVCLI_TOK_BIT(c)	((uint32_t)(MEVCLI_TOK_SPECIAL(c) ? 1 : 0) << ((c) & 31))
+#define MEVCLI_TOK_4(c)		(MEVCLI_TOK_BIT(c) | MEVCLI_TOK_BIT((c) + 1) | \
+				 MEVCLI_TOK_BIT((c) + 2) | MEVCLI_TOK_BIT((c) + 3))
+#define MEVCLI_TOK_16(c)	(MEVCLI_TOK_4(c) | MEVCLI_TOK_4((c) + 4) | \
+				 MEVCLI_TOK_4((c) + 8) | MEVCLI_TOK_4((c) + 12))
+#define MEVCLI_TOK_32(c)	(MEVCLI_TOK_16(c) | MEVCLI_TOK_16((c) + 16))
+
+static const uint32_t mevcli_tok_special[256 / 32] = {
+	MEVCLI_TOK_32(0),	MEVCLI_TOK_32(32),
+	MEVCLI_TOK_32(64),	MEVCLI_TOK_32(96),
+	MEVCLI_TOK_32(128),	MEVCLI_TOK_32(160),
+	MEVCLI_TOK_32(192),	MEVCLI_TOK_32(224),
+};
+
+static bool	mevcli_tok_is_special(char c)
 {
-	for (unsigned int i = 0; i < len; i++)
-		dest[i] = src[i];
+	return (mevcli_tok_special[(uint8_t)c >> 5] >> (c & 31)) & 1;
 }
 
-#if MEVCLI_FEAT_HISTORY
-/* The UI here is:
- * - Type away, edit stuff in current line
- * - Can hit up (then up/down) to browse history;
- *   in effect this copies a historic line into the current,
- *   so it can be further edited, then entered
- * - If you change your mind, hitting down all the way
- *   returns you to the original current line-in-progress
+/* Split len chars of line into args, in one pass and in place: quotes
+ * and escapes are removed, and each arg is terminated.  Fills in
+ * ctx->args and ctx->arg_lens, returning the number of args or
+ * MEVCLI_ERR_ARGS if there are too many, or MEVCLI_ERR_QUOTE.
  *
- * To do this, we need to back up the current line (somewhere other
- * than history, since it might not ever be entered) so as to return
- * to it later if necessary.
+ * With MEVCLI_FEAT_BATCH, this stops after a ";" or "&&" ending a
+ * command, giving its first char in *sep (else 0) and the number of
+ * chars used in *used.
  */
-
-static unsigned int	mevcli_history_copy_browsed_line(mevcli_ctx_t *ctx)
+static int	mevcli_tokenize(mevcli_ctx_t *ctx, char *line, unsigned int len,
+				unsigned int *used, char *sep)
 {
-	/* Find the line corresponding to cur_hist_browse_idx, and
-	 * copy it to the current line buffer:
-	 */
-	int total_histlen = 0;
-	for (int i = 0; i < ctx->cur_hist_browse_idx ; i++) {
-		MEVCLI_ASSERT(ctx->history_strlens[i] != 0);
-		total_histlen += ctx->history_strlens[i];
+	char *w = line;		/* Never ahead of line[i] */
+	unsigned int n = 0;
+	bool in_arg = false;
+	char quote = 0;
+
+	*used = len;
+	*sep = 0;
+	for (unsigned int i = 0; i < len; i++) {
+		char c = line[i];
+
+		if (quote) {
+			if (c == quote) {
+				quote = 0;
+				continue;
+			}
+			if (c == '\\' && quote == '"' && i + 1 < len &&
+			    (line[i + 1] == '"' || line[i + 1] == '\\'))
+				c = line[++i];
+		} else if (mevcli_tok_is_special(c)) {
+			if (c == '"' || c == '\'') {
+				quote = c;
+				c = 0;
+			} else if (c == '\\') {
+				if (i + 1 < len)
+					c = line[++i];
+#if MEVCLI_FEAT_BATCH
+			} else if (c == '&' && (i + 1 == len || line[i + 1] != '&')) {
+				/* Just one is an ordinary char */
+			} else if (c == ';' || c == '&') {
+				*sep = c;
+				*used = i + 1 + (c == '&');
+				break;
+#endif
+			} else {
+				/* A delimiter: end any arg */
+				if (in_arg) {
+					ctx->arg_lens[n - 1] = w - ctx->args[n - 1];
+					*(w++) = '\0';
+					in_arg = false;
+				}
+				continue;
+			}
+		}
+
+		if (!in_arg) {
+			if (n == MEVCLI_MAX_DEPTH + MEVCLI_MAX_ARGS)
+				return MEVCLI_ERR_ARGS;
+			ctx->args[n++] = w;
+			in_arg = true;
+		}
+		if (c)
+			*(w++) = c;
 	}
-	unsigned int linelen = ctx->history_strlens[ctx->cur_hist_browse_idx] - 1;
-	mevcli_cpy(ctx->line, &ctx->history[total_histlen], linelen);
 
-	return linelen;
+	if (quote)
+		return MEVCLI_ERR_QUOTE;
+	if (in_arg) {
+		ctx->arg_lens[n - 1] = w - ctx->args[n - 1];
+		*w = '\0';
+	}
+	return n;
 }
 
-static void	mevcli_cursor_up(mevcli_ctx_t *ctx)
+static bool	mevcli_has_handler(const mevcli_cmd_t *cmd)
 {
-	if (ctx->cur_hist_browse_idx == ctx->history_strlens_topvalid) {
-		/* This includes the case where history_strlens_topvalid == -1
-		 * just after init.
-		 */
-		mevcli_putch(ctx, MEVCLI_BELL_CHAR); /* BOOP! */
-		return;
-	}
+#if MEVCLI_FEAT_TYPED_ARGS
+	if (cmd->typedfn)
+		return true;
+#endif
+	return cmd->cmdfn || cmd->ctxfn;
+}
 
-	if (ctx->cur_hist_browse_idx == -1) {
-		mevcli_cpy(ctx->backup_line, ctx->line, ctx->linepos);
-		ctx->backup_linepos = ctx->linepos;
+/* Is argc the right number of args for cmd? */
+static bool	mevcli_nargs_ok(const mevcli_cmd_t *cmd, unsigned int argc)
+{
+#if MEVCLI_FEAT_TYPED_ARGS
+	if (cmd->argspec) {
+		unsigned int n = cmd->num_argspecs;
+		unsigned int required = 0;
+
+		while (required < n &&
+		       !(cmd->argspec[required].flags & MEVCLI_ARGF_OPTIONAL))
+			required++;
+
+		return argc >= required &&
+			(argc <= n ||
+			 (n > 0 && (cmd->argspec[n - 1].flags & MEVCLI_ARGF_REPEAT)));
+	}
+#endif
+	return cmd->nargs == -1 || cmd->nargs == argc;
+}
+
+#if MEVCLI_FEAT_TYPED_ARGS
+/* Parse decimal, or hex with a 0x prefix; false if it's not a number
+ * or doesn't fit.
+ */
+static bool	mevcli_parse_uint(const char *s, uint32_t *val)
+{
+	unsigned int base = 10;
+	uint32_t v = 0;
+
+	if (s[0] == '0' && mevcli_lowercase_alpha(s[1]) == 'x') {
+		base = 16;
+		s += 2;
+	}
+	if (!*s)
+		return false;
+
+	for ( ; *s; s++) {
+		char c = mevcli_lowercase_alpha(*s);
+		unsigned int d;
+
+		if (c >= '0' && c <= '9')
+			d = c - '0';
+		else if (base == 16 && c >= 'a' && c <= 'f')
+			d = c - 'a' + 10;
+		else
+			return false;
+
+		if (v > (0xffffffffU - d) / base)
+			return false;
+		v = (v * base) + d;
+	}
+	*val = v;
+	return true;
+}
+
+/* Index of s in the NULL-terminated names, or -1 */
+static int	mevcli_parse_enum(char *s, const char *const *names)
+{
+	for (int i = 0; names[i]; i++) {
+		if (mevcli_str_match(s, names[i]))
+			return i;
+	}
+	return -1;
+}
+
+/* Convert arg s according to spec (NULL for a string) into *val;
+ * false if it's invalid.
+ */
+static bool	mevcli_convert_arg(const mevcli_argspec_t *spec, char *s, mevcli_arg_t *val)
+{
+	static const char *const bool_names[] = {
+		"0", "1", "off", "on", "no", "yes", "false", "true", 0
+	};
+	bool ranged = spec && (spec->min != 0 || spec->max != 0);
+	int e;
+
+	switch (spec ? spec->type : MEVCLI_ARG_STR) {
+	case MEVCLI_ARG_INT: {
+		bool neg = (*s == '-');
+
+		if (!mevcli_parse_uint(s + neg, &val->u) ||
+		    val->u > 0x7fffffffU + neg)
+			return false;
+		if (neg)
+			val->u = 0U - val->u;
+		return !ranged || (val->i >= spec->min && val->i <= spec->max);
+	}
+
+	case MEVCLI_ARG_UINT:
+		if (!mevcli_parse_uint(s, &val->u))
+			return false;
+		return !ranged || (val->u >= (uint32_t)spec->min &&
+				   val->u <= (uint32_t)spec->max);
+
+	case MEVCLI_ARG_BOOL:
+		e = mevcli_parse_enum(s, bool_names);
+		val->b = e & 1;
+		return e >= 0;
+
+	case MEVCLI_ARG_ENUM:
+		e = mevcli_parse_enum(s, spec->names);
+		val->u = e;
+		return e >= 0;
+
+	default:
+		val->s = s;
+		return true;
+	}
+}
+
+/* Convert all args for cmd into ctx->typed_args, returning the index of
+ * the first bad one, or -1 if they're all OK.
+ */
+static int	mevcli_convert_args(mevcli_ctx_t *ctx, const mevcli_cmd_t *cmd,
+				    unsigned int argc, char **argv)
+{
+	unsigned int n = cmd->argspec ? cmd->num_argspecs : 0;
+
+	for (unsigned int i = 0; i < argc; i++) {
+		const mevcli_argspec_t *spec = 0;
+
+		if (n > 0)
+			spec = &cmd->argspec[i < n ? i : n - 1];
+		if (!mevcli_convert_arg(spec, argv[i], &ctx->typed_args[i]))
+			return i;
+	}
+	return -1;
+}
+#endif
+
+static int	mevcli_bad_line(mevcli_ctx_t *ctx, int status)
+{
+	if (!ctx->machine_mode) {
+		mevcli_newl(ctx);
+		mevcli_putstr(ctx, status == MEVCLI_ERR_QUOTE ?
+			      "Unterminated quote.\r\n" : "Too many args.\r\n");
+	}
+	return status;
+}
+
+/* Call cmd's handler, returning its status */
+static int	mevcli_call(mevcli_ctx_t *ctx, const mevcli_cmd_t *cmd,
+			    unsigned int argc, char **argv)
+{
+	/* The command might produce output of its own by other means,
+	 * so make sure ours is out first:
+	 */
+	mevcli_flush(ctx);
+#if MEVCLI_FEAT_TYPED_ARGS
+	if (cmd->typedfn)
+		return cmd->typedfn(ctx, cmd->opaque, argc, ctx->typed_args);
+#endif
+	if (cmd->ctxfn)
+		return cmd->ctxfn(ctx, cmd->opaque, argc, argv);
+
+	cmd->cmdfn(cmd->opaque, argc, argv);
+	return MEVCLI_OK;
+}
+
+/* Given a command's nwords words in ctx->args, match the first word
+ * into a command string, and following words into its sub-commands, if
+ * it has them.  Then call it with the remaining words as the argv
+ * array, up to MEVCLI_MAX_ARGS.  Returns the status.
+ */
+static int	mevcli_run_cmd(mevcli_ctx_t *ctx, unsigned int nwords)
+{
+	int status = MEVCLI_OK;
+
+	/* Walk down through sub-command tables as far as the words
+	 * name them:
+	 */
+	const mevcli_cmd_t *path[MEVCLI_MAX_DEPTH];
+	const mevcli_cmd_t *cmd = 0;
+	unsigned int depth = 0;
+	unsigned int num;
+
+	do {
+		const mevcli_cmd_t *cmds = mevcli_level(ctx, cmd, &num);
+		int gotcmd = depth < nwords ?
+			mevcli_find_cmd(ctx, cmd, ctx->args[depth]) : MEVCLI_ERR_UNKNOWN;
+
+		if (gotcmd < 0) {
+			/* A command with a handler takes the rest as args */
+			if (cmd && mevcli_has_handler(cmd))
+				break;
+			if (depth == nwords) {
+				if (!ctx->machine_mode)
+					mevcli_help(ctx, "Sub-command needed", path, depth);
+				return MEVCLI_ERR_ARGS;
+			}
+#if MEVCLI_TRIE_NODES > 0
+			if (gotcmd == MEVCLI_ERR_AMBIGUOUS && depth == 0 && ctx->trie_used) {
+				if (!ctx->machine_mode) {
+					mevcli_newl(ctx);
+					mevcli_putstr(ctx, "Ambiguous command.  Could be:\r\n\r\n");
+					mevcli_trie_list(ctx, mevcli_trie_walk(ctx, ctx->args[0]));
+					mevcli_newl(ctx);
+				}
+				return gotcmd;
+			}
+#endif
+			if (!ctx->machine_mode)
+				mevcli_help(ctx, gotcmd == MEVCLI_ERR_AMBIGUOUS ?
+					    "Ambiguous command" : "Unknown command",
+					    path, depth);
+			return gotcmd;
+		}
+		cmd = &cmds[gotcmd];
+		path[depth++] = cmd;
+	} while (cmd->subcmds && depth < MEVCLI_MAX_DEPTH);
+
+	if (!mevcli_has_handler(cmd)) {
+		/* The tables are deeper than MEVCLI_MAX_DEPTH, or a leaf
+		 * command has no handler
+		 */
+		MEVCLI_ASSERT(0);
+		return MEVCLI_ERR_UNKNOWN;
+	}
+
+	/* Finally, argv is the words after the command */
+	unsigned int argc = nwords - depth;
+	if (argc > MEVCLI_MAX_ARGS)
+		return mevcli_bad_line(ctx, MEVCLI_ERR_ARGS);
+
+	char **argv = &ctx->args[depth];
+	ctx->arg_base = depth;
+
+	if (!mevcli_nargs_ok(cmd, argc)) {
+		if (!ctx->machine_mode)
+			mevcli_help(ctx, "Command args are incorrect", path, depth - 1);
+		return MEVCLI_ERR_ARGS;
+	}
+
+#if MEVCLI_FEAT_TYPED_ARGS
+	if (cmd->typedfn) {
+		int bad = mevcli_convert_args(ctx, cmd, argc, argv);
+
+		if (bad >= 0) {
+			if (!ctx->machine_mode) {
+				mevcli_newl(ctx);
+				mevcli_putstr(ctx, "Bad argument '");
+				mevcli_putstr(ctx, argv[bad]);
+				mevcli_putstr(ctx, "'.  Usage:\r\n\r\n");
+				mevcli_help_line(ctx, path, depth - 1, cmd);
+				mevcli_newl(ctx);
+			}
+			return MEVCLI_ERR_TYPE;
+		}
+	}
+#endif
+
+	ctx->in_cmd = true;
+#if MEVCLI_FEAT_ASYNC
+	ctx->task_pt = 0;
+#endif
+	status = mevcli_call(ctx, cmd, argc, argv);
+
+	if (status == MEVCLI_PENDING || status == MEVCLI_YIELD) {
+#if MEVCLI_FEAT_ASYNC
+		/* Still in the command */
+		ctx->pending = true;
+		ctx->pending_cmd = cmd;
+		ctx->yielding = (status == MEVCLI_YIELD);
+		ctx->task_argc = argc;
+		return MEVCLI_PENDING;
+#else
+		/* Needs MEVCLI_FEAT_ASYNC; the command can't carry on,
+		 * so call it a failure and finish the line.
+		 */
+		MEVCLI_ASSERT(0);
+		status = 1;
+#endif
+	}
+	ctx->in_cmd = false;
+	return status;
+}
+
+/* Run the rest of the line's commands, from batch_next.  After "&&", a
+ * command only runs if the last one succeeded (or, if that was skipped,
+ * the last one that ran).  Returns the status of the last, or
+ * MEVCLI_PENDING if one is still running.
+ */
+static int	mevcli_run_batch(mevcli_ctx_t *ctx, int status)
+{
+	while (ctx->batch_left > 0) {
+		unsigned int used;
+		int nwords = mevcli_tokenize(ctx, ctx->batch_next, ctx->batch_left,
+					     &used, &ctx->batch_sep);
+
+		if (nwords < 0)
+			return mevcli_bad_line(ctx, nwords);
+
+		ctx->batch_next += used;
+		ctx->batch_left -= used;
+		if (ctx->batch_run && nwords > 0) {
+			status = mevcli_run_cmd(ctx, nwords);
+			if (status == MEVCLI_PENDING)
+				return status;
+		}
+		ctx->batch_run = (ctx->batch_sep != '&' || status == MEVCLI_OK);
+	}
+	return status;
+}
+
+static bool	mevcli_cmd_pending(mevcli_ctx_t *ctx)
+{
+#if MEVCLI_FEAT_ASYNC
+	return ctx->pending;
+#else
+	return false;
+#endif
+}
+
+/* A line's done: reset it, and give the prompt or machine mode status */
+static void	mevcli_line_done(mevcli_ctx_t *ctx, int status)
+{
+	ctx->cursorpos = ctx->linepos = 0;
+	if (ctx->machine_mode) {
+		mevcli_putstr(ctx, MEVCLI_MACHINE_TERM);
+		mevcli_putdec(ctx, ctx->machine_seq++);
+		mevcli_putch(ctx, ' ');
+		if (status < 0) {
+			mevcli_putch(ctx, '-');
+			status = -status;
+		}
+		mevcli_putdec(ctx, status);
+		mevcli_newl(ctx);
+	} else {
+		mevcli_prompt(ctx);
+	}
+}
+
+/* Having got an entered line, split it into commands (if there are
+ * several) and those into words, and run each in turn.  The prompt (or
+ * machine mode status) is output once, at the end.
+ */
+static void	mevcli_process_cmd(mevcli_ctx_t *ctx)
+{
+	int status = MEVCLI_OK;
+
+	/* Terminate input line */
+	ctx->line[ctx->linepos] = '\0';
+
+	if (ctx->machine_mode) {
+		if (ctx->machine_overflow) {
+			ctx->machine_overflow = false;
+			status = MEVCLI_ERR_LINE;
+			goto out;
+		}
+	} else {
+		mevcli_newl(ctx);
+	}
+
+	int command_idx = -1;
+	/* Skip past any spaces that might be at the start of the
+	 * line, to find the command:
+	 */
+	for (unsigned int i = 0; i < ctx->linepos; i++) {
+		if (ctx->line[i] > ' ') {
+			command_idx = i;
+			break;
+		}
+	}
+	/* No actual command on the line! */
+	if (command_idx == -1)
+		goto out;
+
+	char *command = &ctx->line[command_idx];
+
+	if (!ctx->machine_mode) {
+		mevcli_history_append(ctx, command,
+				      ctx->linepos - command_idx);
+#if MEVCLI_FEAT_HISTORY_STORE
+		mevcli_history_store_append(ctx);
+#endif
+	}
+
+	ctx->batch_next = command;
+	ctx->batch_left = ctx->linepos - command_idx;
+	ctx->batch_run = true;
+	status = mevcli_run_batch(ctx, status);
+	if (status == MEVCLI_PENDING)
+		return;		/* The rest happens in mevcli_cmd_complete() */
+
+out:
+	mevcli_line_done(ctx, status);
+}
+
+
+///////////////////////// Cursor movement //////////////////////////////////////
+
+static void	mevcli_line_redraw(mevcli_ctx_t *ctx)
+{
+	mevcli_ansi_cursorpos(ctx, ctx->prompt_len);
+	mevcli_ansi_eraseright(ctx);
+	mevcli_putbuf(ctx, ctx->line, ctx->linepos);
+	ctx->term_col = ctx->prompt_len + ctx->linepos;
+	mevcli_ansi_cursorpos(ctx, ctx->prompt_len + ctx->cursorpos);
+}
+
+#if MEVCLI_HISTORY_SEARCH_LEN > 0
+/* Draw the search in place of the prompt and line, as one redraw,
+ * leaving the cursor on the match.
+ */
+static void	mevcli_search_draw(mevcli_ctx_t *ctx)
+{
+	unsigned int col;
+	unsigned int at;
+
+	mevcli_putch(ctx, '\r');
+	col = mevcli_putstr(ctx, ctx->search_failed ? "(failed reverse-i-search)'" :
+			    "(reverse-i-search)'");
+	mevcli_putbuf(ctx, ctx->search, ctx->search_len);
+	col += ctx->search_len + mevcli_putstr(ctx, "': ");
+	at = col;
+	if (ctx->search_found) {
+		mevcli_hist_rd_t rd;
+
+		mevcli_history_open(ctx, &rd, ctx->search_age);
+		while (mevcli_history_chunk(ctx, &rd)) {
+			mevcli_putbuf(ctx, rd.c, rd.clen);
+			col += rd.clen;
+		}
+		at += ctx->search_at;
+	}
+	mevcli_ansi_eraseright(ctx);
+	ctx->term_col = col;
+	mevcli_ansi_cursorpos(ctx, at);
+}
+#endif
+
+#if MEVCLI_LOG_BUFLEN > 0
+/* Draw any queued log messages in place of the prompt and line, then
+ * redraw those below.
+ */
+static void	mevcli_log_draw(mevcli_ctx_t *ctx)
+{
+	unsigned int head = ctx->log_head;
+	unsigned int tail = ctx->log_tail;
+	MEVCLI_BARRIER();
+
+	if (head == tail || ctx->in_cmd)
+		return;
+
+	/* Machine mode has no prompt/line shown, just whole lines */
+	if (!ctx->machine_mode) {
+		mevcli_putch(ctx, '\r');
+		mevcli_ansi_eraseline(ctx);
+	}
+	while (tail != head) {
+		char c = ctx->log_ring[tail++ & (MEVCLI_LOG_BUFLEN - 1)];
+
+		if (c == '\n')
+			mevcli_newl(ctx);
+		else
+			mevcli_putch(ctx, c);
+	}
+	MEVCLI_BARRIER();
+	ctx->log_tail = tail;
+
+	unsigned int dropped = ctx->log_dropped - ctx->log_dropped_shown;
+
+	if (dropped) {
+		ctx->log_dropped_shown += dropped;
+		mevcli_putstr(ctx, "[");
+		mevcli_putdec(ctx, dropped);
+		mevcli_putstr(ctx, " log messages dropped]");
+		mevcli_newl(ctx);
+	}
+
+#if MEVCLI_HISTORY_SEARCH_LEN > 0
+	if (ctx->searching) {
+		mevcli_search_draw(ctx);
+		return;
+	}
+#endif
+	if (!ctx->machine_mode) {
+		mevcli_prompt(ctx);
+		mevcli_line_redraw(ctx);
+	}
+}
+#endif
+
+static void	mevcli_cpy(char *dest, const char *src, unsigned int len)
+{
+	for (unsigned int i = 0; i < len; i++)
+		dest[i] = src[i];
+}
+
+/* Update the terminal after an edit of the line buffer: at position
+ * 'at', 'removed' chars were taken out and 'inserted' chars put in
+ * (ctx->line/linepos already reflect this).  Chars after the edit are
+ * unchanged, but shifted.  Choose the cheapest of:
+ *
+ * - Repainting everything from 'at' to the end of the line, then
+ *   erasing leftovers if the line got shorter, or
+ * - Opening up/closing the gap in place with ICH/DCH, and only
+ *   painting the inserted chars.
+ *
+ * Erase-char (ECH) is never cheaper than erase-right here, as the line
+ * is always the rightmost thing on screen.  The cursor is left at
+ * ctx->cursorpos.
+ */
+static void	mevcli_redraw_edit(mevcli_ctx_t *ctx, unsigned int at,
+				   unsigned int removed, unsigned int inserted)
+{
+	mevcli_ansi_cursorpos(ctx, ctx->prompt_len + at);
+
+	if (ctx->term_caps & MEVCLI_TERM_CAP_ICH_DCH) {
+		unsigned int repaint = ctx->linepos - at +
+			(removed > inserted ? 3 : 0);
+		unsigned int ichdch = inserted;
+
+		if (removed > inserted)
+			ichdch += mevcli_ansi_csi_len(removed - inserted);
+		else if (inserted > removed)
+			ichdch += mevcli_ansi_csi_len(inserted - removed);
+
+		if (ichdch < repaint) {
+			if (removed > inserted)
+				mevcli_ansi_csi(ctx, removed - inserted, 'P');
+			else if (inserted > removed)
+				mevcli_ansi_csi(ctx, inserted - removed, '@');
+			mevcli_putbuf(ctx, &ctx->line[at], inserted);
+			ctx->term_col += inserted;
+			goto out;
+		}
+	}
+
+	mevcli_putbuf(ctx, &ctx->line[at], ctx->linepos - at);
+	ctx->term_col += ctx->linepos - at;
+	if (removed > inserted)
+		mevcli_ansi_eraseright(ctx);
+out:
+	mevcli_ansi_cursorpos(ctx, ctx->prompt_len + ctx->cursorpos);
+}
+
+/* The line buffer has just been replaced by len new chars, which keep
+ * the first prefix and last suffix of the oldlen chars on screen.
+ * Redraw what changed and leave the cursor at the end; even if nothing
+ * changed, the cursor may have been elsewhere in the line.
+ */
+static void	mevcli_line_replaced(mevcli_ctx_t *ctx, unsigned int oldlen,
+				     unsigned int len, unsigned int prefix,
+				     unsigned int suffix)
+{
+	ctx->linepos = len;
+	ctx->cursorpos = len;
+
+	if (prefix == oldlen && prefix == len)	/* Identical */
+		mevcli_ansi_cursorpos(ctx, ctx->prompt_len + ctx->cursorpos);
+	else
+		mevcli_redraw_edit(ctx, prefix, oldlen - prefix - suffix,
+				   len - prefix - suffix);
+}
+
+/* Replace the whole line with len chars from src, leaving the cursor
+ * at the end.  The old and new lines are compared, so that only the
+ * part between any common prefix and suffix is redrawn (e.g. when
+ * browsing through similar history entries).
+ */
+static void	mevcli_line_replace(mevcli_ctx_t *ctx, const char *src, unsigned int len)
+{
+	unsigned int oldlen = ctx->linepos;
+	unsigned int minlen = oldlen < len ? oldlen : len;
+	unsigned int prefix = 0;
+	unsigned int suffix = 0;
+
+	while (prefix < minlen && ctx->line[prefix] == src[prefix])
+		prefix++;
+	while (suffix < (minlen - prefix) &&
+	       ctx->line[oldlen - 1 - suffix] == src[len - 1 - suffix])
+		suffix++;
+
+	mevcli_cpy(ctx->line, src, len);
+	mevcli_line_replaced(ctx, oldlen, len, prefix, suffix);
+}
+
+#if MEVCLI_FEAT_HISTORY
+/* The UI here is:
+ * - Type away, edit stuff in current line
+ * - Can hit up (then up/down) to browse history;
+ *   in effect this copies a historic line into the current,
+ *   so it can be further edited, then entered
+ * - If something was typed first, only lines starting with it
+ *   are browsed
+ * - If you change your mind, hitting down all the way
+ *   returns you to the original current line-in-progress
+ *
+ * To do this, we need to back up the current line (somewhere other
+ * than history, since it might not ever be entered) so as to return
+ * to it later if necessary.
+ */
+
+static void	mevcli_history_show_browsed_line(mevcli_ctx_t *ctx)
+{
+	/* Make the line corresponding to cur_hist_browse_idx the
+	 * current line:
+	 */
+	mevcli_hist_rd_t rd;
+
+	mevcli_history_open(ctx, &rd, ctx->cur_hist_browse_idx);
+	mevcli_history_chunk(ctx, &rd);
+	if (rd.left == 0) {
+		/* All in one piece */
+		mevcli_line_replace(ctx, rd.c, rd.clen);
+		return;
+	}
+
+	/* Otherwise it's expanded straight into the line, so only a
+	 * common prefix is kept on screen.
+	 */
+	unsigned int oldlen = ctx->linepos;
+	unsigned int len = 0;
+	unsigned int prefix = 0;
+	int c;
+
+	while ((c = mevcli_history_getc(ctx, &rd)) >= 0) {
+		if (prefix == len && len < oldlen && ctx->line[len] == c)
+			prefix++;
+		ctx->line[len++] = c;
+	}
+	mevcli_line_replaced(ctx, oldlen, len, prefix, 0);
+}
+
+/* If a partial line had been typed before browsing, only entries
+ * starting with it (as kept in backup_line) are stepped through.
+ */
+static bool	mevcli_history_has_prefix(mevcli_ctx_t *ctx, unsigned int age)
+{
+	mevcli_hist_rd_t rd;
+
+	mevcli_history_open(ctx, &rd, age);
+	for (unsigned int i = 0; i < ctx->backup_linepos; i++) {
+		if (mevcli_history_getc(ctx, &rd) != ctx->backup_line[i])
+			return false;
+	}
+	return true;
+}
+
+static void	mevcli_cursor_up(mevcli_ctx_t *ctx)
+{
+	int idx = ctx->cur_hist_browse_idx;
+
+	if (idx == -1) {
+		mevcli_cpy(ctx->backup_line, ctx->line, ctx->linepos);
+		ctx->backup_linepos = ctx->linepos;
+	}
+	do {
+		idx++;
+	} while (idx < (int)ctx->hist_num && !mevcli_history_has_prefix(ctx, idx));
+
+	if (idx >= (int)ctx->hist_num) {
+		/* This includes the case where there's no history
+		 * just after init.
+		 */
+		mevcli_putch(ctx, MEVCLI_BELL_CHAR); /* BOOP! */
+		return;
+	}
+	ctx->cur_hist_browse_idx = idx;
+
+	mevcli_history_show_browsed_line(ctx);
+}
+
+static void	mevcli_cursor_down(mevcli_ctx_t *ctx)
+{
+	int idx = ctx->cur_hist_browse_idx;
+
+	if (idx == -1) {
+		mevcli_putch(ctx, MEVCLI_BELL_CHAR); /* BOOP! */
+		return;
+	}
+
+	do {
+		idx--;
+	} while (idx >= 0 && !mevcli_history_has_prefix(ctx, idx));
+
+	if (idx < 0) {
+		/* Restore edit buffer; the user didn't like that
+		 * history experience.
+		 */
+		mevcli_line_replace(ctx, ctx->backup_line, ctx->backup_linepos);
+		ctx->cur_hist_browse_idx = -1;
+	} else {
+		ctx->cur_hist_browse_idx = idx;
+
+		mevcli_history_show_browsed_line(ctx);
+	}
+}
+
+#if MEVCLI_HISTORY_SEARCH_LEN > 0
+/* ^R reverse search: each key narrows or steps the search and the
+ * result is drawn in one go, but ctx->line isn't touched until the
+ * match is accepted.  Searches carry on from the current match, so
+ * a keypress never looks at an entry more than once.
+ */
+static void	mevcli_search_start(mevcli_ctx_t *ctx)
+{
+	ctx->searching = true;
+	ctx->search_len = 0;
+	ctx->search_found = false;
+	ctx->search_failed = false;
+	mevcli_search_draw(ctx);
+}
+
+/* Find the search string at or before offset at in the entry of the
+ * given age, or in older entries.  The match is only updated if
+ * found.  This is KMP, so that each entry is read once, forwards, as
+ * it's expanded.
+ */
+static bool	mevcli_search_find(mevcli_ctx_t *ctx, unsigned int age, unsigned int at)
+{
+	const char *s = ctx->search;
+	unsigned int n = ctx->search_len;
+	uint8_t fail[MEVCLI_HISTORY_SEARCH_LEN];
+
+	/* fail[i]: the longest proper prefix of s[0..i] that ends it */
+	fail[0] = 0;
+	for (unsigned int i = 1, k = 0; i < n; i++) {
+		while (k > 0 && s[i] != s[k])
+			k = fail[k - 1];
+		if (s[i] == s[k])
+			k++;
+		fail[i] = k;
+	}
+
+	for ( ; age < ctx->hist_num; age++, at = MEVCLI_MAX_LINE_LEN) {
+		mevcli_hist_rd_t rd;
+		unsigned int k = 0;
+		int found = -1;
+		int c;
+
+		/* Matches ending before at + n start at or before at */
+		mevcli_history_open(ctx, &rd, age);
+		for (unsigned int p = 0; p < at + n &&
+			     (c = mevcli_history_getc(ctx, &rd)) >= 0; p++) {
+			while (k > 0 && c != s[k])
+				k = fail[k - 1];
+			if (c == s[k])
+				k++;
+			if (k == n) {
+				found = p + 1 - n;
+				k = fail[n - 1];
+			}
+		}
+		if (found >= 0) {
+			ctx->search_age = age;
+			ctx->search_at = found;
+			ctx->search_found = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Look again for the (changed) search string, from the current
+ * match, or step to an older one.
+ */
+static void	mevcli_search_update(mevcli_ctx_t *ctx, bool older)
+{
+	unsigned int age = 0;
+	unsigned int at = MEVCLI_MAX_LINE_LEN;
+
+	if (ctx->search_len == 0) {
+		ctx->search_found = ctx->search_failed = false;
+		return;
+	}
+	if (ctx->search_found) {
+		age = ctx->search_age;
+		at = ctx->search_at;
+		if (older) {
+			if (at > 0) {
+				at--;
+			} else {
+				age++;
+				at = MEVCLI_MAX_LINE_LEN;
+			}
+		}
+	}
+	ctx->search_failed = !mevcli_search_find(ctx, age, at);
+	if (ctx->search_failed)
+		mevcli_putch(ctx, MEVCLI_BELL_CHAR);
+}
+
+/* Leave the search, taking the match into the line if accept */
+static void	mevcli_search_end(mevcli_ctx_t *ctx, bool accept)
+{
+	ctx->searching = false;
+	if (accept && ctx->search_found) {
+		mevcli_hist_rd_t rd;
+		unsigned int len = 0;
+		int c;
+
+		/* Carry on browsing from here with up/down */
+		if (ctx->cur_hist_browse_idx == -1) {
+			mevcli_cpy(ctx->backup_line, ctx->line, ctx->linepos);
+			ctx->backup_linepos = ctx->linepos;
+		}
+		ctx->cur_hist_browse_idx = ctx->search_age;
+		mevcli_history_open(ctx, &rd, ctx->search_age);
+		while ((c = mevcli_history_getc(ctx, &rd)) >= 0)
+			ctx->line[len++] = c;
+		ctx->cursorpos = ctx->linepos = len;
+	}
+	mevcli_putch(ctx, '\r');
+	mevcli_prompt(ctx);
+	mevcli_line_redraw(ctx);
+}
+
+/* Returns true if the key was used by the search; any other key ends
+ * the search, and then does its usual job on the accepted line.
+ */
+static bool	mevcli_search_input(mevcli_ctx_t *ctx, char in)
+{
+	switch (in) {
+	case '\x12': /* ^R */
+		mevcli_search_update(ctx, true);
+		break;
+
+	case '\x07': /* ^G */
+		mevcli_search_end(ctx, false);
+		return true;
+
+	case '\x7f': /* DEL */
+		if (ctx->search_len == 0)
+			return true;
+		ctx->search_len--;
+		/* The shorter string matches where the longer did */
+		if (ctx->search_len == 0 || !ctx->search_found || ctx->search_failed)
+			mevcli_search_update(ctx, false);
+		break;
+
+	default:
+		if (in < ' ' || in > 126) {
+			mevcli_search_end(ctx, true);
+			return false;
+		}
+		if (ctx->search_len == MEVCLI_HISTORY_SEARCH_LEN) {
+			mevcli_putch(ctx, MEVCLI_BELL_CHAR);
+			return true;
+		}
+		ctx->search[ctx->search_len++] = in;
+		/* If it failed before, it fails with more */
+		if (!ctx->search_failed)
+			mevcli_search_update(ctx, false);
+	}
+	mevcli_search_draw(ctx);
+	return true;
+}
+#endif
+#else
+static void	mevcli_cursor_up(mevcli_ctx_t *ctx)
+{
+}
+static void	mevcli_cursor_down(mevcli_ctx_t *ctx)
+{
+}
+#endif
+
+
+static void	mevcli_cursor_right(mevcli_ctx_t *ctx)
+{
+	if (ctx->cursorpos < ctx->linepos) {
+		ctx->cursorpos++;
+		mevcli_ansi_cursorpos(ctx, ctx->cursorpos + ctx->prompt_len);
+	}
+}
+
+static void	mevcli_cursor_left(mevcli_ctx_t *ctx)
+{
+	if (ctx->cursorpos > 0) {
+		ctx->cursorpos--;
+		mevcli_ansi_cursorpos(ctx, ctx->cursorpos + ctx->prompt_len);
+	}
+}
+
+/* From the current cursor position, search leftwards (downwards)
+ * in the line for a whitespace boundary and return the index
+ * of the last character before (right of) the space.  If the
+ * current character is immediately right of whitespace, skip
+ * through the initial whitespace.
+ */
+static unsigned int	mevcli_search_word_left(mevcli_ctx_t *ctx)
+{
+	bool saw_real_char = false;
+	if (ctx->cursorpos > 0) {
+		for (unsigned int i = ctx->cursorpos; i > 0; i--) {
+			if (ctx->line[i - 1] <= ' ') {
+				if (saw_real_char)
+					return i;
+			} else {
+				saw_real_char = true;
+			}
+		}
+		/* No gap?  Fall through and return start of string */
+	}
+	return 0;
+}
+
+/* As above, but search right (up) and return the index of the
+ * first space.	 If the current cursor position is in whitespace,
+ * skip over it first.
+ */
+static unsigned int	mevcli_search_word_right(mevcli_ctx_t *ctx)
+{
+	bool saw_real_char = false;
+	if (ctx->cursorpos < ctx->linepos) {
+		for (unsigned int i = ctx->cursorpos; i < ctx->linepos; i++) {
+			if (ctx->line[i] <= ' ') {
+				if (saw_real_char)
+					return i;
+			} else {
+				saw_real_char = true;
+			}
+		}
+		/* No gap?  Fall through and return end of string */
+	}
+	return ctx->linepos;
+}
+
+static void	mevcli_cursor_right_word(mevcli_ctx_t *ctx)
+{
+	ctx->cursorpos = mevcli_search_word_right(ctx);
+	mevcli_ansi_cursorpos(ctx, ctx->cursorpos + ctx->prompt_len);
+}
+
+static void	mevcli_cursor_left_word(mevcli_ctx_t *ctx)
+{
+	ctx->cursorpos = mevcli_search_word_left(ctx);
+	mevcli_ansi_cursorpos(ctx, ctx->cursorpos + ctx->prompt_len);
+}
+
+static void	mevcli_cursor_start(mevcli_ctx_t *ctx)
+{
+	if (ctx->cursorpos > 0) {
+		ctx->cursorpos = 0;
+		mevcli_ansi_cursorpos(ctx, ctx->prompt_len);
+	}
+}
+
+static void	mevcli_cursor_end(mevcli_ctx_t *ctx)
+{
+	if (ctx->cursorpos < ctx->linepos) {
+		ctx->cursorpos = ctx->linepos;
+		mevcli_ansi_cursorpos(ctx, ctx->cursorpos + ctx->prompt_len);
+	}
+}
+
+
+///////////////////////// Editing/insertion ////////////////////////////////////
+
+/* Delete chars from cursor down to pos, which might be left a char, a
+ * word, or all the way to zero.
+ */
+static void	mevcli_cut_down_to(mevcli_ctx_t *ctx, unsigned int pos)
+{
+	MEVCLI_ASSERT(pos <= ctx->cursorpos);
+	unsigned int distance = ctx->cursorpos - pos;
+
+	if (distance == 0)
+		return;
+
+	if (ctx->cursorpos == ctx->linepos) {
+		ctx->cursorpos = ctx->linepos = pos;
+		if (distance == 1) {
+			/* Shortcut for common case of cursor at end
+			 * of line, deleting one char: Noddy 'rubout'
+			 * by backspace-overwrite-backspace'ing:
+			 */
+			mevcli_putstr(ctx, "\b \b");
+			ctx->term_col--;
+			return;
+		}
+	} else {
+		for (unsigned int i = ctx->cursorpos; i < ctx->linepos; i++) {
+			ctx->line[pos + i - ctx->cursorpos] = ctx->line[i];
+		}
+		ctx->linepos -= distance;
+		ctx->cursorpos = pos;
 	}
-	ctx->cur_hist_browse_idx++;
-
-	unsigned int linelen = mevcli_history_copy_browsed_line(ctx);
-	ctx->linepos = linelen;
-	ctx->cursorpos = linelen;
 
-	mevcli_line_redraw(ctx);
+	mevcli_redraw_edit(ctx, pos, distance, 0);
 }
 
-static void	mevcli_cursor_down(mevcli_ctx_t *ctx)
+/* Regular user-hits-delete, take one char off at cursor pos (if there
+ * are any chars there!)
+ */
+static void	mevcli_char_delete(mevcli_ctx_t *ctx)
+{
+	if (ctx->cursorpos > 0)
+		mevcli_cut_down_to(ctx, ctx->cursorpos - 1);
+}
+
+/* Delete-right, take one char off after the cursor pos */
+static void	mevcli_char_delete_right(mevcli_ctx_t *ctx)
+{
+	if (ctx->cursorpos < ctx->linepos) {
+		ctx->linepos--;
+		for (unsigned int i = ctx->cursorpos; i < ctx->linepos; i++) {
+			ctx->line[i] = ctx->line[i + 1];
+		}
+		mevcli_redraw_edit(ctx, ctx->cursorpos, 1, 0);
+	}
+}
+
+/* Cut the line from the cursor leftwards to the beginning */
+static void	mevcli_cut_start(mevcli_ctx_t *ctx)
+{
+	mevcli_cut_down_to(ctx, 0);
+}
+
+/* Cut the line from the cursor leftwards one word */
+static void	mevcli_cut_word(mevcli_ctx_t *ctx)
+{
+	mevcli_cut_down_to(ctx, mevcli_search_word_left(ctx));
+}
+
+/* Delete rightwards until end of line */
+static void	mevcli_cut_end(mevcli_ctx_t *ctx)
+{
+	if (ctx->cursorpos < ctx->linepos) {
+		mevcli_ansi_eraseright(ctx);
+		ctx->linepos = ctx->cursorpos;
+	}
+}
+
+/* Regular user input at cursor, of one or more chars; appends if
+ * cursor at end of string, else make a gap, insert, and redraw.
+ * A run of chars is inserted (and redrawn) in one go.
+ */
+static void	mevcli_chars_insert(mevcli_ctx_t *ctx, const char *in, unsigned int len)
 {
-	if (ctx->cur_hist_browse_idx == -1) {
+	unsigned int at = ctx->cursorpos;
+
+	if (len > MEVCLI_MAX_LINE_LEN - ctx->linepos) {
+		/* No room (for all of it), soz */
 		mevcli_putch(ctx, MEVCLI_BELL_CHAR); /* BOOP! */
-		return;
+		len = MEVCLI_MAX_LINE_LEN - ctx->linepos;
+		if (len == 0)
+			return;
 	}
 
-	if (ctx->cur_hist_browse_idx == 0) {
-		/* Restore edit buffer; the user didn't like that
-		 * history experience.
-		 */
-		mevcli_cpy(ctx->line, ctx->backup_line, ctx->backup_linepos);
-		ctx->linepos = ctx->backup_linepos;
-		ctx->cursorpos = ctx->backup_linepos;
-		ctx->cur_hist_browse_idx = -1;
+	if (at == ctx->linepos) {
+		/* Simple, common case: append at end of line */
+		mevcli_cpy(&ctx->line[at], in, len);
+		ctx->linepos += len;
+		ctx->cursorpos += len;
+		mevcli_putbuf(ctx, in, len);
+		ctx->term_col += len;
 	} else {
-		ctx->cur_hist_browse_idx--;
-
-		unsigned int linelen = mevcli_history_copy_browsed_line(ctx);
-		ctx->linepos = linelen;
-		ctx->cursorpos = linelen;
+		/* Extend line; copy (backwards!) from cursor upwards */
+		for (unsigned int i = ctx->linepos; i > at; i--) {
+			ctx->line[i - 1 + len] = ctx->line[i - 1];
+		}
+		/* Insert chars, move cursor */
+		mevcli_cpy(&ctx->line[at], in, len);
+		ctx->linepos += len;
+		ctx->cursorpos += len;
+		mevcli_redraw_edit(ctx, at, 0, len);
 	}
+}
 
-	mevcli_line_redraw(ctx);
+static void	mevcli_char_insert(mevcli_ctx_t *ctx, char in)
+{
+	mevcli_chars_insert(ctx, &in, 1);
 }
-#else
-static void	mevcli_cursor_up(mevcli_ctx_t *ctx)
+
+
+///////////////////////// Completion ///////////////////////////////////////////
+
+#if MEVCLI_FEAT_COMPLETION
+/* The i'th completion candidate: a command name (in index order, if
+ * there's an index) from the level below cmd if argn is negative, else
+ * from cmd's arg completer.  NULL when there are no more.
+ */
+static const char	*mevcli_compl_cand(mevcli_ctx_t *ctx, const mevcli_cmd_t *cmd,
+					   int argn, unsigned int i)
 {
+	if (argn >= 0)
+		return cmd->complete(cmd->opaque, argn, i);
+
+	unsigned int num;
+	const mevcli_cmd_t *cmds = mevcli_level(ctx, cmd, &num);
+
+	if (i >= num)
+		return 0;
+#if MEVCLI_FEAT_CMD_INDEX
+	const uint16_t *index = cmd ? cmd->subcmd_index : ctx->cmd_index;
+	if (index)
+		i = index[i];
+#endif
+	return cmds[i].name;
 }
-static void	mevcli_cursor_down(mevcli_ctx_t *ctx)
+
+/* Print the candidates from lo to hi matching word, in columns, then
+ * redraw the prompt and line below them.
+ */
+static void	mevcli_compl_list(mevcli_ctx_t *ctx, const mevcli_cmd_t *cmd, int argn,
+				  const char *word, unsigned int len,
+				  unsigned int lo, unsigned int hi)
+{
+	const char *name;
+	unsigned int width = 0;
+
+	for (unsigned int i = lo; i < hi && (name = mevcli_compl_cand(ctx, cmd, argn, i)); i++) {
+		if (mevcli_prefix_match(word, len, name) &&
+		    (unsigned int)mevcli_strlen(name) > width)
+			width = mevcli_strlen(name);
+	}
+	width += 2;
+
+	unsigned int cols = MEVCLI_TERM_WIDTH / width;
+	unsigned int col = 0;
+	unsigned int pad = 0;
+
+	if (cols == 0)
+		cols = 1;	/* A candidate wider than the terminal */
+
+	mevcli_newl(ctx);
+	for (unsigned int i = lo; i < hi && (name = mevcli_compl_cand(ctx, cmd, argn, i)); i++) {
+		if (!mevcli_prefix_match(word, len, name))
+			continue;
+		if (col == cols) {
+			mevcli_newl(ctx);
+			col = 0;
+		} else {
+			for ( ; pad > 0; pad--)
+				mevcli_putch(ctx, ' ');
+		}
+		pad = width - mevcli_putstr(ctx, name);
+		col++;
+	}
+	mevcli_newl(ctx);
+
+	/* Fresh prompt, so no need to erase anything */
+	mevcli_prompt(ctx);
+	mevcli_putbuf(ctx, ctx->line, ctx->linepos);
+	ctx->term_col += ctx->linepos;
+	mevcli_ansi_cursorpos(ctx, ctx->prompt_len + ctx->cursorpos);
+}
+
+/* Complete the word before the cursor: a command name if it's the first
+ * word (or a sub-command name, after a command with sub-commands), else
+ * an arg using the command's completer, if it has one.
+ * Extend the word to the longest common prefix of the candidates (and
+ * add a space if there's just one).  If that doesn't add anything,
+ * beep, or list the candidates if this is a repeated tab.
+ *
+ * For top-level command names, the set of candidates for the last
+ * completed prefix is cached as the span of them in the table (or
+ * index), and if the word is an extension of that prefix, only the span
+ * is searched.
+ */
+static void	mevcli_complete(mevcli_ctx_t *ctx, bool again)
 {
+	unsigned int start = ctx->cursorpos;
+	const mevcli_cmd_t *cmd = 0;
+	int argn = -1;
+	unsigned int lo = 0;
+	unsigned int hi = ~0U;
+
+	while (start > 0 && ctx->line[start - 1] > ' ')
+		start--;
+	const char *word = &ctx->line[start];
+	unsigned int len = ctx->cursorpos - start;
+
+	/* Which arg is this?  Walk the words before it down through
+	 * the sub-commands they name, as for running the command.
+	 */
+	unsigned int depth = 0;
+	for (unsigned int i = 0; i < start; i++) {
+		if (ctx->line[i] <= ' ' || (i > 0 && ctx->line[i - 1] > ' '))
+			continue;
+		if (argn < 0) {
+			unsigned int end = i;
+			while (ctx->line[end] > ' ')
+				end++;
+
+			char c = ctx->line[end];
+			ctx->line[end] = '\0';
+			int n = mevcli_find_cmd(ctx, cmd, &ctx->line[i]);
+			ctx->line[end] = c;
+
+			if (n >= 0) {
+				unsigned int num;
+				cmd = &mevcli_level(ctx, cmd, &num)[n];
+				if (!cmd->subcmds || ++depth == MEVCLI_MAX_DEPTH)
+					argn = 0;
+				continue;
+			}
+			if (!cmd || !mevcli_has_handler(cmd)) {
+				mevcli_putch(ctx, MEVCLI_BELL_CHAR);
+				return;
+			}
+			argn = 0;
+		}
+		argn++;
+	}
+
+	if (argn >= 0) {
+		if (!cmd->complete) {
+			mevcli_putch(ctx, MEVCLI_BELL_CHAR);
+			return;
+		}
+	} else if (cmd) {
+		hi = cmd->num_subcmds;
+	} else {
+		hi = ctx->num_commands;
+		if (ctx->compl_count > 0 && len >= ctx->compl_len &&
+		    mevcli_prefix_match(word, ctx->compl_len,
+					mevcli_compl_cand(ctx, 0, -1, ctx->compl_first))) {
+			lo = ctx->compl_first;
+			hi = ctx->compl_last + 1;
+		}
+	}
+
+	const char *match = 0;
+	const char *name;
+	unsigned int count = 0;
+	unsigned int first = 0;
+	unsigned int last = 0;
+	unsigned int common = 0;
+
+	for (unsigned int i = lo; i < hi && (name = mevcli_compl_cand(ctx, cmd, argn, i)); i++) {
+		if (!mevcli_prefix_match(word, len, name))
+			continue;
+		if (count++ == 0) {
+			first = i;
+			match = name;
+			common = mevcli_strlen(name);
+		} else {
+			unsigned int j = len;
+			while (j < common && mevcli_lowercase_alpha(name[j]) ==
+			       mevcli_lowercase_alpha(match[j]))
+				j++;
+			common = j;
+		}
+		last = i;
+	}
+
+	if (!cmd) {
+		/* Top level names only */
+		ctx->compl_first = first;
+		ctx->compl_last = last;
+		ctx->compl_count = count;
+		ctx->compl_len = len;
+	}
+
+	if (count == 0) {
+		mevcli_putch(ctx, MEVCLI_BELL_CHAR);
+	} else if (common > len) {
+		mevcli_chars_insert(ctx, &match[len], common - len);
+		if (count == 1)
+			mevcli_char_insert(ctx, ' ');
+	} else if (count == 1) {
+		if (ctx->cursorpos == ctx->linepos || ctx->line[ctx->cursorpos] > ' ')
+			mevcli_char_insert(ctx, ' ');
+	} else if (again) {
+		mevcli_compl_list(ctx, cmd, argn, word, len, first, last + 1);
+	} else {
+		mevcli_putch(ctx, MEVCLI_BELL_CHAR);
+	}
 }
 #endif
 
 
-static void	mevcli_cursor_right(mevcli_ctx_t *ctx)
+///////////////////////// Input processing /////////////////////////////////////
+
+#if MEVCLI_FEAT_ASYNC
+/* Input while a command is pending is kept for later, apart from ^C */
+static void	mevcli_pending_input(mevcli_ctx_t *ctx, char in)
 {
-	if (ctx->cursorpos < ctx->linepos) {
-		ctx->cursorpos++;
-		mevcli_ansi_cursorpos(ctx, ctx->cursorpos + ctx->prompt_len);
+	if (in == '\x03') {
+		if (ctx->pending_cmd->cancel)
+			ctx->pending_cmd->cancel(ctx, ctx->pending_cmd->opaque);
+	} else if (ctx->typeahead_len < MEVCLI_TYPEAHEAD_LEN) {
+		ctx->typeahead[ctx->typeahead_len++] = in;
+	} else {
+		mevcli_putch(ctx, MEVCLI_BELL_CHAR);
 	}
 }
+#endif
 
-static void	mevcli_cursor_left(mevcli_ctx_t *ctx)
+/* In machine mode, input just collects into the line until CR, LF or
+ * CRLF, with no echo or editing.  Control chars are dropped, and lines
+ * that don't fit are reported (as MEVCLI_ERR_LINE) rather than run.
+ * Returns the number of chars consumed, which is fewer than len if a
+ * command leaves machine mode.
+ */
+static unsigned int	mevcli_machine_input(mevcli_ctx_t *ctx, const char *buf, unsigned int len)
 {
-	if (ctx->cursorpos > 0) {
-		ctx->cursorpos--;
-		mevcli_ansi_cursorpos(ctx, ctx->cursorpos + ctx->prompt_len);
+	for (unsigned int i = 0; i < len; i++) {
+		char c = buf[i];
+		char last = ctx->machine_last;
+
+		ctx->machine_last = c;
+		if (c == '\r' || c == '\n') {
+			if (c == '\n' && last == '\r')
+				continue;
+			mevcli_process_cmd(ctx);
+			if (!ctx->machine_mode || mevcli_cmd_pending(ctx))
+				return i + 1;
+		} else if (c == '\t' || (c >= ' ' && c <= 126)) {
+			if (ctx->linepos < MEVCLI_MAX_LINE_LEN)
+				ctx->line[ctx->linepos++] = c;
+			else
+				ctx->machine_overflow = true;
+		}
 	}
+	return len;
 }
 
-/* From the current cursor position, search leftwards (downwards)
- * in the line for a whitespace boundary and return the index
- * of the last character before (right of) the space.  If the
- * current character is immediately right of whitespace, skip
- * through the initial whitespace.
+#if MEVCLI_FEAT_BRACKETED_PASTE
+/* Collect pasted chars.  Printable chars and line breaks are kept,
+ * where CR, LF or CRLF all become one '\r'.  Anything else is dropped,
+ * as is anything that doesn't fit.
  */
-static unsigned int	mevcli_search_word_left(mevcli_ctx_t *ctx)
+static void	mevcli_paste_add(mevcli_ctx_t *ctx, const char *in, unsigned int len)
 {
-	bool saw_real_char = false;
-	if (ctx->cursorpos > 0) {
-		for (unsigned int i = ctx->cursorpos; i > 0; i--) {
-			if (ctx->line[i - 1] <= ' ') {
-				if (saw_real_char)
-					return i;
-			} else {
-				saw_real_char = true;
+	for (unsigned int i = 0; i < len; i++) {
+		char c = in[i];
+
+		if (c == '\n') {
+			if (ctx->paste_last == '\r') {
+				ctx->paste_last = c;
+				continue;
 			}
+			c = '\r';
+		} else if (c != '\r' && (c < ' ' || c > 126)) {
+			continue;
 		}
-		/* No gap?  Fall through and return start of string */
+		ctx->paste_last = in[i];
+
+		if (ctx->paste_len >= MEVCLI_PASTE_BUFLEN) {
+			ctx->paste_overflow = true;
+			continue;
+		}
+		ctx->paste_buf[ctx->paste_len++] = c;
 	}
-	return 0;
 }
 
-/* As above, but search right (up) and return the index of the
- * first space.	 If the current cursor position is in whitespace,
- * skip over it first.
+static void	mevcli_paste_start(mevcli_ctx_t *ctx)
+{
+	ctx->pasting = true;
+	ctx->paste_overflow = false;
+	ctx->paste_last = 0;
+	ctx->paste_len = 0;
+}
+
+/* At the end of a paste, insert each line into the line buffer in one
+ * go, and run it if it ended in a line break.  A line that doesn't fit
+ * is dropped at its break, rather than part of it run.  Text after the
+ * last break remains in the line for editing.
  */
-static unsigned int	mevcli_search_word_right(mevcli_ctx_t *ctx)
+static void	mevcli_paste_end(mevcli_ctx_t *ctx)
 {
-	bool saw_real_char = false;
-	if (ctx->cursorpos < ctx->linepos) {
-		for (unsigned int i = ctx->cursorpos; i < ctx->linepos; i++) {
-			if (ctx->line[i] <= ' ') {
-				if (saw_real_char)
-					return i;
-			} else {
-				saw_real_char = true;
+	unsigned int start = 0;
+
+	if (!ctx->pasting)
+		return;
+	ctx->pasting = false;
+
+	for (unsigned int i = 0; i <= ctx->paste_len; i++) {
+		if (i == ctx->paste_len || ctx->paste_buf[i] == '\r') {
+			bool fits = i - start <= MEVCLI_MAX_LINE_LEN - ctx->linepos;
+
+			if (i > start)
+				mevcli_chars_insert(ctx, &ctx->paste_buf[start], i - start);
+			if (i < ctx->paste_len && !fits) {
+				/* Truncated (with a BEL); leave it unrun */
+				mevcli_newl(ctx);
+				mevcli_line_done(ctx, MEVCLI_ERR_LINE);
+			} else if (i < ctx->paste_len) {
+				mevcli_process_cmd(ctx);
+#if MEVCLI_FEAT_ASYNC
+				if (ctx->pending) {
+					/* Keep the rest for after it */
+					while (++i < ctx->paste_len)
+						mevcli_pending_input(ctx, ctx->paste_buf[i]);
+					break;
+				}
+#endif
 			}
+			start = i + 1;
+		}
+	}
+
+	if (ctx->paste_overflow)
+		mevcli_putch(ctx, MEVCLI_BELL_CHAR);
+}
+#endif
+
+/* Escape sequences are decoded by a small table-driven state machine.
+ * Each input char is put into one of a few classes, and the table gives
+ * an action and next state for each state/class pair.  CSI (ESC [) and
+ * SS3 (ESC O) parameters are collected as numbers (up to
+ * MEVCLI_CSI_MAX_PARAMS), and any private marker or intermediate char
+ * is noted.  Complete sequences are then looked up in mevcli_keys[].
+ */
+enum {
+	MEVCLI_CC_CTRL,		/* Control chars, DEL and non-ASCII */
+	MEVCLI_CC_ESC,
+	MEVCLI_CC_INTERM,	/* 0x20-0x2f */
+	MEVCLI_CC_DIGIT,
+	MEVCLI_CC_SEP,		/* ';' */
+	MEVCLI_CC_PRIV,		/* ':', '<', '=', '>', '?' */
+	MEVCLI_CC_LBRACKET,
+	MEVCLI_CC_O,
+	MEVCLI_CC_FINAL,	/* Rest of 0x40-0x7e */
+	MEVCLI_CC_NUM
+};
+
+enum {
+	MEVCLI_EA_PASS,		/* Not part of a sequence; regular input */
+	MEVCLI_EA_IGNORE,
+	MEVCLI_EA_START,	/* ESC [ or ESC O: clear params */
+	MEVCLI_EA_DIGIT,
+	MEVCLI_EA_SEP,
+	MEVCLI_EA_MARK,
+	MEVCLI_EA_DISPATCH,
+};
+
+/* Entries are (action << 2) | next state */
+#define MEVCLI_ET(a, s)		(((MEVCLI_EA_ ## a) << 2) | (MEVCLI_ESC_ ## s))
+
+static const uint8_t mevcli_esc_table[4][MEVCLI_CC_NUM] = {
+	[MEVCLI_ESC_GROUND] = {
+		MEVCLI_ET(PASS, GROUND),	MEVCLI_ET(IGNORE, ESC),
+		MEVCLI_ET(PASS, GROUND),	MEVCLI_ET(PASS, GROUND),
+		MEVCLI_ET(PASS, GROUND),	MEVCLI_ET(PASS, GROUND),
+		MEVCLI_ET(PASS, GROUND),	MEVCLI_ET(PASS, GROUND),
+		MEVCLI_ET(PASS, GROUND),
+	},
+	[MEVCLI_ESC_ESC] = {
+		MEVCLI_ET(IGNORE, GROUND),	MEVCLI_ET(IGNORE, ESC),
+		MEVCLI_ET(IGNORE, GROUND),	MEVCLI_ET(DISPATCH, GROUND),
+		MEVCLI_ET(DISPATCH, GROUND),	MEVCLI_ET(DISPATCH, GROUND),
+		MEVCLI_ET(START, CSI),		MEVCLI_ET(START, SS3),
+		MEVCLI_ET(DISPATCH, GROUND),
+	},
+	[MEVCLI_ESC_CSI] = {
+		MEVCLI_ET(PASS, GROUND),	MEVCLI_ET(IGNORE, ESC),
+		MEVCLI_ET(MARK, CSI),		MEVCLI_ET(DIGIT, CSI),
+		MEVCLI_ET(SEP, CSI),		MEVCLI_ET(MARK, CSI),
+		MEVCLI_ET(DISPATCH, GROUND),	MEVCLI_ET(DISPATCH, GROUND),
+		MEVCLI_ET(DISPATCH, GROUND),
+	},
+	[MEVCLI_ESC_SS3] = {
+		MEVCLI_ET(PASS, GROUND),	MEVCLI_ET(IGNORE, ESC),
+		MEVCLI_ET(MARK, SS3),		MEVCLI_ET(DIGIT, SS3),
+		MEVCLI_ET(SEP, SS3),		MEVCLI_ET(MARK, SS3),
+		MEVCLI_ET(DISPATCH, GROUND),	MEVCLI_ET(DISPATCH, GROUND),
+		MEVCLI_ET(DISPATCH, GROUND),
+	},
+};
+
+static unsigned int	mevcli_esc_class(char in)
+{
+	if (in == '\e')
+		return MEVCLI_CC_ESC;
+	if (in < ' ' || in > 126)
+		return MEVCLI_CC_CTRL;
+	if (in < '0')
+		return MEVCLI_CC_INTERM;
+	if (in <= '9')
+		return MEVCLI_CC_DIGIT;
+	if (in == ';')
+		return MEVCLI_CC_SEP;
+	if (in < '@')
+		return MEVCLI_CC_PRIV;
+	if (in == '[')
+		return MEVCLI_CC_LBRACKET;
+	if (in == 'O')
+		return MEVCLI_CC_O;
+	return MEVCLI_CC_FINAL;
+}
+
+/* Complete sequences are matched against this table.  'intro' is the
+ * char after ESC ('[' for CSI, 'O' for SS3, or 0 for a plain ESC-char),
+ * and 'param' the first parameter, where 0 matches any.  If the
+ * sequence has a modifier parameter (e.g. ESC[1;5D for ctrl-left),
+ * modfn is used in preference to fn, if given.
+ */
+typedef struct {
+	char intro;
+	char final;
+	uint16_t param;
+	void (*fn)(mevcli_ctx_t *ctx);
+	void (*modfn)(mevcli_ctx_t *ctx);
+} mevcli_key_t;
+
+static const mevcli_key_t mevcli_keys[] = {
+	{ '[', 'A', 0, mevcli_cursor_up, 0 },
+	{ '[', 'B', 0, mevcli_cursor_down, 0 },
+	{ '[', 'C', 0, mevcli_cursor_right, mevcli_cursor_right_word },
+	{ '[', 'D', 0, mevcli_cursor_left, mevcli_cursor_left_word },
+	{ '[', 'H', 0, mevcli_cursor_start, 0 },
+	{ '[', 'F', 0, mevcli_cursor_end, 0 },
+	{ '[', '~', 1, mevcli_cursor_start, 0 },
+	{ '[', '~', 3, mevcli_char_delete_right, 0 },
+	{ '[', '~', 4, mevcli_cursor_end, 0 },
+	{ '[', '~', 7, mevcli_cursor_start, 0 },
+	{ '[', '~', 8, mevcli_cursor_end, 0 },
+#if MEVCLI_FEAT_BRACKETED_PASTE
+	{ '[', '~', 200, mevcli_paste_start, 0 },
+	{ '[', '~', 201, mevcli_paste_end, 0 },
+#endif
+	{ 'O', 'A', 0, mevcli_cursor_up, 0 },
+	{ 'O', 'B', 0, mevcli_cursor_down, 0 },
+	{ 'O', 'C', 0, mevcli_cursor_right, mevcli_cursor_right_word },
+	{ 'O', 'D', 0, mevcli_cursor_left, mevcli_cursor_left_word },
+	{ 'O', 'H', 0, mevcli_cursor_start, 0 },
+	{ 'O', 'F', 0, mevcli_cursor_end, 0 },
+	/* rxvt sends these for CTRL-right/CTRL-left */
+	{ 'O', 'c', 0, mevcli_cursor_right_word, 0 },
+	{ 'O', 'd', 0, mevcli_cursor_left_word, 0 },
+	/* Some terminals send CTRL-left/CTRL-right as ESC-b, ESC-f.
+	 * We implement this as "move word left/right".
+	 */
+	{ 0, 'b', 0, mevcli_cursor_left_word, 0 },
+	{ 0, 'f', 0, mevcli_cursor_right_word, 0 },
+};
+
+static void	mevcli_process_key(mevcli_ctx_t *ctx, char final)
+{
+	/* Sequences with private markers or intermediates aren't keys
+	 * (e.g. terminal responses); ignore them.
+	 */
+	if (ctx->esc_mark)
+		return;
+
+	unsigned int param = ctx->esc_nparams > 0 ? ctx->esc_params[0] : 0;
+	bool modified = ctx->esc_nparams > 1 && ctx->esc_params[1] > 1;
+
+	for (unsigned int i = 0; i < sizeof(mevcli_keys)/sizeof(mevcli_key_t); i++) {
+		const mevcli_key_t *k = &mevcli_keys[i];
+
+		if (k->intro == ctx->esc_intro && k->final == final &&
+		    (k->param == 0 || k->param == param)) {
+			if (modified && k->modfn)
+				k->modfn(ctx);
+			else
+				k->fn(ctx);
+			return;
+		}
+	}
+	/* Unknown; the whole sequence is dropped */
+}
+
+/* Check input chars against escape/CSI tracking.  Returns true if
+ * handled.
+ */
+static bool	mevcli_process_esc_seq(mevcli_ctx_t *ctx, char in)
+{
+	uint8_t e = mevcli_esc_table[ctx->esc_state][mevcli_esc_class(in)];
+	unsigned int prev_state = ctx->esc_state;
+
+	ctx->esc_state = e & 3;
+
+	switch (e >> 2) {
+	case MEVCLI_EA_PASS:
+		return false;
+
+	case MEVCLI_EA_START:
+		ctx->esc_intro = in;
+		ctx->esc_nparams = 0;
+		ctx->esc_mark = 0;
+		break;
+
+	case MEVCLI_EA_DIGIT:
+		if (ctx->esc_nparams == 0) {
+			ctx->esc_params[0] = 0;
+			ctx->esc_nparams = 1;
+		}
+		if (ctx->esc_nparams <= MEVCLI_CSI_MAX_PARAMS) {
+			uint16_t *p = &ctx->esc_params[ctx->esc_nparams - 1];
+			if (*p < 1000)
+				*p = (*p * 10) + (in - '0');
+		}
+		break;
+
+	case MEVCLI_EA_SEP:
+		if (ctx->esc_nparams == 0)
+			ctx->esc_params[ctx->esc_nparams++] = 0;
+		if (ctx->esc_nparams < MEVCLI_CSI_MAX_PARAMS)
+			ctx->esc_params[ctx->esc_nparams] = 0;
+		ctx->esc_nparams++;
+		break;
+
+	case MEVCLI_EA_MARK:
+		ctx->esc_mark = in;
+		break;
+
+	case MEVCLI_EA_DISPATCH:
+		if (prev_state == MEVCLI_ESC_ESC) {
+			ctx->esc_intro = 0;
+			ctx->esc_nparams = 0;
+			ctx->esc_mark = 0;
+		}
+		mevcli_process_key(ctx, in);
+		break;
+
+	default: /* MEVCLI_EA_IGNORE */
+		break;
+	}
+	return true;
+}
+
+
+///////////////////////// External API /////////////////////////////////////////
+
+void	mevcli_init(mevcli_ctx_t *ctx, const mevcli_cmd_t *cmds, unsigned int num_cmds,
+		    void (*cb_output_char)(char out))
+{
+	ctx->commands = cmds;
+	ctx->num_commands = num_cmds;
+#if MEVCLI_FEAT_CMD_INDEX
+	ctx->cmd_index = 0;
+#endif
+#if MEVCLI_TRIE_NODES > 0
+	mevcli_trie_build(ctx);
+#endif
+	ctx->cb_output_char = cb_output_char;
+	ctx->term_caps = MEVCLI_TERM_CAPS;
+	ctx->term_col = 0;
+#if MEVCLI_FEAT_COMPLETION
+	ctx->compl_tab = false;
+	ctx->compl_count = 0;
+#endif
+	ctx->machine_mode = false;
+	ctx->in_cmd = false;
+#if MEVCLI_FEAT_ASYNC
+	ctx->pending = false;
+	ctx->yielding = false;
+	ctx->typeahead_len = 0;
+#endif
+#if MEVCLI_OUTBUF_LEN > 0
+	ctx->cb_output_buf = 0;
+	ctx->outbuf_len = 0;
+#endif
+#if MEVCLI_RXRING_LEN > 0
+	ctx->cb_rx_flow = 0;
+	ctx->rx_head = ctx->rx_tail = 0;
+	ctx->rx_stopped = false;
+	ctx->rx_overflows = 0;
+#endif
+#if MEVCLI_TXRING_LEN > 0
+	ctx->cb_tx_kick = 0;
+	ctx->cb_tx_highwater = 0;
+	ctx->tx_head = ctx->tx_tail = 0;
+	ctx->tx_above_highwater = false;
+	ctx->tx_dropped = 0;
+#endif
+#if MEVCLI_LOG_BUFLEN > 0
+	ctx->log_head = ctx->log_tail = 0;
+	ctx->log_dropped = ctx->log_dropped_shown = 0;
+#endif
+	ctx->esc_state = MEVCLI_ESC_GROUND;
+	ctx->cursorpos = ctx->linepos = 0;
+#if MEVCLI_FEAT_BRACKETED_PASTE
+	ctx->pasting = false;
+	mevcli_putstr(ctx, "\e[?2004h");
+#endif
+
+#if MEVCLI_FEAT_HISTORY
+	ctx->hist_head = ctx->hist_num = ctx->hist_wr = 0;
+#if MEVCLI_FEAT_HISTORY_COMPRESS
+	ctx->hist_dict = 0;
+#endif
+	ctx->cur_hist_browse_idx = -1;
+#endif
+#if MEVCLI_HISTORY_SEARCH_LEN > 0
+	ctx->searching = false;
+#endif
+#if MEVCLI_FEAT_HISTORY_STORE
+	ctx->hist_store = 0;
+#endif
+
+	mevcli_prompt(ctx);
+	mevcli_flush(ctx);
+}
+
+#if MEVCLI_FEAT_PRINTF
+void	mevcli_vprintf(mevcli_ctx_t *ctx, const char *fmt, va_list ap)
+{
+	for ( ; *fmt; fmt++) {
+		if (*fmt != '%') {
+			mevcli_putch(ctx, *fmt);
+			continue;
+		}
+
+		bool left = false;
+		char pad = ' ';
+		unsigned int width = 0;
+
+		for (fmt++; *fmt == '-' || *fmt == '0'; fmt++) {
+			if (*fmt == '-')
+				left = true;
+			else
+				pad = '0';
+		}
+		for ( ; *fmt >= '0' && *fmt <= '9'; fmt++)
+			width = (width * 10) + (*fmt - '0');
+		if (left)
+			pad = ' ';
+
+		/* Left-justified fields are padded afterwards, so print
+		 * at no width and pad up to it after.
+		 */
+		unsigned int before = left ? 0 : width;
+		const char *s;
+		unsigned int len;
+		int d;
+
+		switch (*fmt) {
+		case 'd':
+			d = va_arg(ap, int);
+			len = mevcli_putnum_len(d < 0 ? 0U - d : d, 10) + (d < 0);
+			mevcli_putnum(ctx, d < 0 ? 0U - d : d, 10, false, d < 0, before, pad);
+			break;
+
+		case 'u':
+		case 'x':
+		case 'X': {
+			unsigned int base = *fmt == 'u' ? 10 : 16;
+			unsigned int u = va_arg(ap, unsigned int);
+
+			len = mevcli_putnum_len(u, base);
+			mevcli_putnum(ctx, u, base, *fmt == 'X', false, before, pad);
+			break;
+		}
+
+		case 's':
+			s = va_arg(ap, const char *);
+			len = mevcli_strlen(s);
+			if (before > len)
+				mevcli_pad(ctx, ' ', before - len);
+			mevcli_putbuf(ctx, s, len);
+			break;
+
+		case 'c':
+			len = 1;
+			if (before > len)
+				mevcli_pad(ctx, ' ', before - len);
+			mevcli_putch(ctx, (char)va_arg(ap, int));
+			break;
+
+		case '%':
+			len = 1;
+			mevcli_putch(ctx, '%');
+			break;
+
+		default:	/* Unsupported, or the end */
+			if (!*fmt)
+				fmt--;
+			continue;
 		}
-		/* No gap?  Fall through and return end of string */
+		if (left && width > len)
+			mevcli_pad(ctx, ' ', width - len);
 	}
-	return ctx->linepos;
-}
 
-static void	mevcli_cursor_right_word(mevcli_ctx_t *ctx)
-{
-	ctx->cursorpos = mevcli_search_word_right(ctx);
-	mevcli_ansi_cursorpos(ctx, ctx->cursorpos + ctx->prompt_len);
+	/* Who knows where that left the cursor */
+	ctx->term_col = MEVCLI_COL_UNKNOWN;
 }
 
-static void	mevcli_cursor_left_word(mevcli_ctx_t *ctx)
+void	mevcli_printf(mevcli_ctx_t *ctx, const char *fmt, ...)
 {
-	ctx->cursorpos = mevcli_search_word_left(ctx);
-	mevcli_ansi_cursorpos(ctx, ctx->cursorpos + ctx->prompt_len);
+	va_list ap;
+
+	va_start(ap, fmt);
+	mevcli_vprintf(ctx, fmt, ap);
+	va_end(ap);
 }
+#endif
 
-static void	mevcli_cursor_start(mevcli_ctx_t *ctx)
+void	mevcli_set_machine_mode(mevcli_ctx_t *ctx, bool on)
 {
-	if (ctx->cursorpos > 0) {
-		ctx->cursorpos = 0;
-		mevcli_ansi_cursorpos(ctx, ctx->prompt_len);
+	if (on == ctx->machine_mode)
+		return;
+
+	ctx->machine_mode = on;
+	if (on) {
+		ctx->machine_seq = 0;
+		ctx->machine_last = 0;
+		ctx->machine_overflow = false;
+	}
+	/* Outside of a command (which will do this on completion),
+	 * get rid of any partial line and show the new mode:
+	 */
+	if (!ctx->in_cmd) {
+		ctx->cursorpos = ctx->linepos = 0;
+		if (!on) {
+			mevcli_newl(ctx);
+			mevcli_prompt(ctx);
+		}
+		mevcli_flush(ctx);
 	}
 }
 
-static void	mevcli_cursor_end(mevcli_ctx_t *ctx)
+#if MEVCLI_FEAT_CMD_INDEX
+void	mevcli_set_cmd_index(mevcli_ctx_t *ctx, const uint16_t *index)
 {
-	if (ctx->cursorpos < ctx->linepos) {
-		ctx->cursorpos = ctx->linepos;
-		mevcli_ansi_cursorpos(ctx, ctx->cursorpos + ctx->prompt_len);
+	if (index) {
+		for (unsigned int i = 1; i < ctx->num_commands; i++) {
+			/* Sorted, and no duplicates */
+			MEVCLI_ASSERT(mevcli_str_cmp(ctx->commands[index[i - 1]].name,
+						     ctx->commands[index[i]].name) < 0);
+		}
 	}
+	ctx->cmd_index = index;
+#if MEVCLI_FEAT_COMPLETION
+	ctx->compl_count = 0;	/* Cache is in index order */
+#endif
 }
 
-
-///////////////////////// Editing/insertion ////////////////////////////////////
-
-/* Delete chars from cursor down to pos, which might be left a char, a
- * word, or all the way to zero.
- */
-static void	mevcli_cut_down_to(mevcli_ctx_t *ctx, unsigned int pos)
+void	mevcli_build_cmd_index(const mevcli_cmd_t *cmds, unsigned int num_cmds,
+			       uint16_t *index)
 {
-	MEVCLI_ASSERT(pos <= ctx->cursorpos);
-	unsigned int distance = ctx->cursorpos - pos;
-
-	if (ctx->cursorpos == ctx->linepos) {
-		ctx->cursorpos = ctx->linepos = pos;
-		if (distance == 1) {
-			/* Shortcut for common case of cursor at end
-			 * of line, deleting one char: Noddy 'rubout'
-			 * by backspace-overwrite-backspace'ing:
-			 */
-			mevcli_putstr(ctx, "\b \b");
-			return;
-		}
-	} else {
-		for (unsigned int i = ctx->cursorpos; i < ctx->linepos; i++) {
-			ctx->line[pos + i - ctx->cursorpos] = ctx->line[i];
+	/* Insertion sort: small, and this is done once */
+	for (unsigned int i = 0; i < num_cmds; i++) {
+		unsigned int j = i;
+
+		for ( ; j > 0; j--) {
+			if (mevcli_str_cmp(cmds[index[j - 1]].name, cmds[i].name) <= 0)
+				break;
+			index[j] = index[j - 1];
 		}
-		ctx->linepos -= distance;
-		ctx->cursorpos = pos;
-	}
-
-	/* Move cursor to pos, erase rightward, redraw, put cursor back */
-	mevcli_ansi_cursorpos(ctx, ctx->prompt_len + ctx->cursorpos);
-	mevcli_ansi_eraseright(ctx);
-	for (unsigned int i = ctx->cursorpos; i < ctx->linepos; i++) {
-		mevcli_putch(ctx, ctx->line[i]);
+		index[j] = i;
 	}
-	mevcli_ansi_cursorpos(ctx, ctx->prompt_len + ctx->cursorpos);
 }
+#endif
 
-/* Regular user-hits-delete, take one char off at cursor pos (if there
- * are any chars there!)
- */
-static void	mevcli_char_delete(mevcli_ctx_t *ctx)
+unsigned int	mevcli_arg_len(mevcli_ctx_t *ctx, int n)
 {
-	if (ctx->cursorpos > 0)
-		mevcli_cut_down_to(ctx, ctx->cursorpos - 1);
+	return ctx->arg_lens[ctx->arg_base + n];
 }
 
-/* Cut the line from the cursor leftwards to the beginning */
-static void	mevcli_cut_start(mevcli_ctx_t *ctx)
+void	mevcli_set_term_caps(mevcli_ctx_t *ctx, unsigned int caps)
 {
-	mevcli_cut_down_to(ctx, 0);
+	ctx->term_caps = caps;
 }
 
-/* Cut the line from the cursor leftwards one word */
-static void	mevcli_cut_word(mevcli_ctx_t *ctx)
+#if MEVCLI_OUTBUF_LEN > 0
+void	mevcli_set_output_buf(mevcli_ctx_t *ctx,
+			      void (*cb_output_buf)(const char *out, unsigned int len))
 {
-	mevcli_cut_down_to(ctx, mevcli_search_word_left(ctx));
+	ctx->cb_output_buf = cb_output_buf;
+	mevcli_flush(ctx);
 }
+#endif
 
-/* Delete rightwards until end of line */
-static void	mevcli_cut_end(mevcli_ctx_t *ctx)
+#if MEVCLI_TXRING_LEN > 0
+void	mevcli_set_tx_ring(mevcli_ctx_t *ctx, void (*cb_tx_kick)(void),
+			   void (*cb_tx_highwater)(bool above))
 {
-	if (ctx->cursorpos < ctx->linepos) {
-		mevcli_ansi_eraseright(ctx);
-		ctx->linepos = ctx->cursorpos;
-	}
+	ctx->cb_tx_kick = cb_tx_kick;
+	ctx->cb_tx_highwater = cb_tx_highwater;
+	mevcli_flush(ctx);
 }
 
-/* Regular user input at cursor; appends if cursor at end of
- * string, else make a gap, insert, and redraw.
+/* Only the consumer clears tx_above_highwater, after the producer has
+ * reported true and set it, so each true is followed by one false.  The
+ * ring is measured after seeing the flag, so that it includes whatever
+ * the producer queued before setting it.
  */
-static void	mevcli_char_insert(mevcli_ctx_t *ctx, char in)
+static void	mevcli_tx_lowwater(mevcli_ctx_t *ctx)
 {
-	if (ctx->linepos >= MEVCLI_MAX_LINE_LEN) {
-		/* No room, soz */
-		mevcli_putch(ctx, MEVCLI_BELL_CHAR); /* BOOP! */
+	if (!ctx->tx_above_highwater)
 		return;
-	}
-
-	if (ctx->cursorpos == ctx->linepos) {
-		/* Simple, common case: append at end of line */
-		ctx->line[ctx->linepos++] = in;
-		ctx->cursorpos++;
-		mevcli_putch(ctx, in);
-	} else {
-		/* Extend line; copy (backwards!) from cursor upwards */
-		ctx->linepos++;
-		for (int i = ctx->linepos; i > ctx->cursorpos; i--) {
-			ctx->line[i] = ctx->line[i - 1];
-		}
-		/* Insert char, move cursor */
-		ctx->line[ctx->cursorpos++] = in;
-		/* Redraw from cursor-1 up */
-		mevcli_ansi_cursorpos(ctx, ctx->prompt_len + ctx->cursorpos - 1);
-		mevcli_ansi_eraseright(ctx);	/* belt and braces, not technically needed */
-		for (unsigned int i = ctx->cursorpos - 1; i < ctx->linepos; i++) {
-			mevcli_putch(ctx, ctx->line[i]);
-		}
-		mevcli_ansi_cursorpos(ctx, ctx->prompt_len + ctx->cursorpos);
+	MEVCLI_BARRIER();
+	if ((ctx->tx_head - ctx->tx_tail) < MEVCLI_TXRING_LOWWATER) {
+		ctx->tx_above_highwater = false;
+		if (ctx->cb_tx_highwater)
+			ctx->cb_tx_highwater(false);
 	}
 }
 
-
-///////////////////////// Input processing /////////////////////////////////////
-
-/* Check input chars against escape/CSI tracking.  Returns true if
- * handled.
- */
-static bool	mevcli_process_esc_seq(mevcli_ctx_t *ctx, char in)
+unsigned int	mevcli_tx_take(mevcli_ctx_t *ctx, const char **data)
 {
-	/* Looking for CSI sequence, mainly to spot cursor
-	 * keys.  Bomb out of the FSM if anything gets tricky.
-	 */
-
-	bool ret = false;
-
-	switch (ctx->csi_fsm_state) {
-	case 0:
-		if (in == '\e') {
-			ctx->csi_fsm_state = 1;
-			ret = true;
-		}
-		break;
-
-	case 1: /* Saw ESC; did we get full CSI ^[[? */
-		ctx->csi_fsm_state = 0;
-		ret = true;
-
-		switch (in) {
-		case '[':
-			ctx->csi_fsm_state = 2;
-			break;
-
-		case 'b':
-			/* Some terminals send CTRL-left/CTRL-right as
-			 * ESC-b, ESC-f.  We implement this as "move
-			 * word left/right".
-			 */
-			mevcli_cursor_left_word(ctx);
-			break;
+	unsigned int tail = ctx->tx_tail;
+	unsigned int used = ctx->tx_head - tail;
+	MEVCLI_BARRIER();
 
-		case 'f':
-			mevcli_cursor_right_word(ctx);
-			break;
-
-		default:
-			/* Unexpected, escape-somethingweird.  Ignore
-			 * the escaped char
-			 */
-			break;
-		}
-		break;
+	/* Catches the ring having drained before the flag was set */
+	mevcli_tx_lowwater(ctx);
 
-	default: /* 2; Saw full CSI */
-		switch (in) {
-		case 'A':
-			mevcli_cursor_up(ctx);
-			break;
-		case 'B':
-			mevcli_cursor_down(ctx);
-			break;
-		case 'C':
-			mevcli_cursor_right(ctx);
-			break;
-		case 'D':
-			mevcli_cursor_left(ctx);
-			break;
-		}
-		/* FIXME: Could support ESC[3~ for delete char right.*/
+	unsigned int offs = tail & (MEVCLI_TXRING_LEN - 1);
+	unsigned int to_end = MEVCLI_TXRING_LEN - offs;
 
-		ctx->csi_fsm_state = 0;
-		ret = true;
-	}
-	return ret;
+	*data = &ctx->txring[offs];
+	return used < to_end ? used : to_end;
 }
 
-
-///////////////////////// External API /////////////////////////////////////////
-
-void	mevcli_init(mevcli_ctx_t *ctx, const mevcli_cmd_t *cmds, unsigned int num_cmds,
-		    void (*cb_output_char)(char out))
+void	mevcli_tx_done(mevcli_ctx_t *ctx, unsigned int len)
 {
-	ctx->commands = cmds;
-	ctx->num_commands = num_cmds;
-	ctx->cb_output_char = cb_output_char;
-	ctx->csi_fsm_state = 0;
-	ctx->cursorpos = ctx->linepos = 0;
-
-#if MEVCLI_FEAT_HISTORY
-	for (int i = 0; i < MEVCLI_HISTORY_MAX_STRS; i++)
-		ctx->history_strlens[i] = 0;
-
-	ctx->history_strlens_topvalid = -1;
-	ctx->cur_hist_browse_idx = -1;
-#endif
+	MEVCLI_ASSERT(len <= ctx->tx_head - ctx->tx_tail);
+	MEVCLI_BARRIER();
+	ctx->tx_tail += len;
 
-	mevcli_prompt(ctx);
+	mevcli_tx_lowwater(ctx);
 }
+#endif
 
-void	mevcli_input_char(mevcli_ctx_t *ctx, const char in)
+static void	mevcli_input_one(mevcli_ctx_t *ctx, const char in)
 {
 	/* Process Emacs/bash-like basics in navigation and editing.
 	 * Delete, left/right cursors, and
@@ -928,11 +3858,29 @@ void	mevcli_input_char(mevcli_ctx_t *ctx, const char in)
 	 *	(Paste unsupported)
 	 * ^A:	Go to start of line
 	 * ^E:	Go to end of line
+	 * ^R:	Reverse search through history (^G to give up)
 	 */
 #ifdef _MEVCLI_DEBUG_INPUT
 	printf("(%x)", in);
 #endif
 
+#if MEVCLI_FEAT_ASYNC
+	if (ctx->pending) {
+		mevcli_pending_input(ctx, in);
+		return;
+	}
+#endif
+	if (ctx->machine_mode) {
+		mevcli_machine_input(ctx, &in, 1);
+		return;
+	}
+
+#if MEVCLI_HISTORY_SEARCH_LEN > 0
+	if (ctx->searching && ctx->esc_state == MEVCLI_ESC_GROUND &&
+	    mevcli_search_input(ctx, in))
+		return;
+#endif
+
 	/* Special case for escape sequence handling:
 	 * if it's an escape, or we're tracking a CSI sequence,
 	 * drop out of regular handling.
@@ -940,10 +3888,25 @@ void	mevcli_input_char(mevcli_ctx_t *ctx, const char in)
 	if (mevcli_process_esc_seq(ctx, in))
 		return;
 
+#if MEVCLI_FEAT_BRACKETED_PASTE
+	if (ctx->pasting) {
+		mevcli_paste_add(ctx, &in, 1);
+		return;
+	}
+#endif
+
 	/* Regular handling resumes */
+#if MEVCLI_FEAT_COMPLETION
+	bool again = ctx->compl_tab;
+	ctx->compl_tab = false;
+#endif
+
 	switch (in) {
 	case '\t':
-		/* FIXME */
+#if MEVCLI_FEAT_COMPLETION
+		mevcli_complete(ctx, again);
+		ctx->compl_tab = true;
+#endif
 		break;
 
 	case '\r':
@@ -974,6 +3937,12 @@ void	mevcli_input_char(mevcli_ctx_t *ctx, const char in)
 		mevcli_cut_end(ctx);
 		break;
 
+#if MEVCLI_HISTORY_SEARCH_LEN > 0
+	case '\x12': /* ^R */
+		mevcli_search_start(ctx);
+		break;
+#endif
+
 		/* Other control characters are ignored, below */
 
 	default:
@@ -983,4 +3952,306 @@ void	mevcli_input_char(mevcli_ctx_t *ctx, const char in)
 	}
 }
 
+void	mevcli_input_char(mevcli_ctx_t *ctx, const char in)
+{
+	mevcli_input_one(ctx, in);
+#if MEVCLI_LOG_BUFLEN > 0
+	mevcli_log_draw(ctx);
+#endif
+	mevcli_flush(ctx);
+}
+
+static void	mevcli_input_run(mevcli_ctx_t *ctx, const char *buf, unsigned int len)
+{
+	unsigned int i = 0;
+
+	while (i < len) {
+#if MEVCLI_FEAT_ASYNC
+		if (ctx->pending) {
+			mevcli_pending_input(ctx, buf[i++]);
+			continue;
+		}
+#endif
+		if (ctx->machine_mode) {
+			i += mevcli_machine_input(ctx, &buf[i], len - i);
+			continue;
+		}
+#if MEVCLI_HISTORY_SEARCH_LEN > 0
+		if (ctx->searching) {
+			mevcli_input_one(ctx, buf[i++]);
+			continue;
+		}
+#endif
+
+		/* Fast path: a run of printable chars, outside of any
+		 * escape sequence, goes into the line in one go.
+		 */
+		unsigned int run = 0;
+		if (ctx->esc_state == MEVCLI_ESC_GROUND) {
+			while (i + run < len &&
+			       buf[i + run] >= ' ' && buf[i + run] <= 126)
+				run++;
+		}
+
+		if (run > 0) {
+#if MEVCLI_FEAT_COMPLETION
+			ctx->compl_tab = false;
+#endif
+#if MEVCLI_FEAT_BRACKETED_PASTE
+			if (ctx->pasting)
+				mevcli_paste_add(ctx, &buf[i], run);
+			else
+#endif
+				mevcli_chars_insert(ctx, &buf[i], run);
+			i += run;
+		} else {
+			mevcli_input_one(ctx, buf[i++]);
+		}
+	}
+}
+
+void	mevcli_input_buf(mevcli_ctx_t *ctx, const char *buf, unsigned int len)
+{
+	mevcli_input_run(ctx, buf, len);
+#if MEVCLI_LOG_BUFLEN > 0
+	mevcli_log_draw(ctx);
+#endif
+	mevcli_flush(ctx);
+}
+
+#if MEVCLI_FEAT_ASYNC
+void	mevcli_cmd_complete(mevcli_ctx_t *ctx, int status)
+{
+	MEVCLI_ASSERT(ctx->pending);
+	ctx->pending = false;
+	ctx->yielding = false;
+	ctx->in_cmd = false;
+
+	ctx->batch_run = (ctx->batch_sep != '&' || status == MEVCLI_OK);
+	status = mevcli_run_batch(ctx, status);
+	if (status != MEVCLI_PENDING) {
+		mevcli_line_done(ctx, status);
+
+		/* Now catch up with the input, which might start another
+		 * pending command; if so, keep the rest.
+		 */
+		unsigned int i = 0;
+		while (i < ctx->typeahead_len && !ctx->pending)
+			mevcli_input_one(ctx, ctx->typeahead[i++]);
+
+		unsigned int left = ctx->typeahead_len - i;
+		mevcli_cpy(ctx->typeahead, &ctx->typeahead[i], left);
+		ctx->typeahead_len = left;
+	}
+	mevcli_flush(ctx);
+}
+
+bool	mevcli_tick(mevcli_ctx_t *ctx)
+{
+	if (!ctx->pending || !ctx->yielding)
+		return false;
+
+	int status = mevcli_call(ctx, ctx->pending_cmd, ctx->task_argc,
+				 &ctx->args[ctx->arg_base]);
+
+	if (status == MEVCLI_PENDING) {
+		/* Now waiting for mevcli_cmd_complete() */
+		ctx->yielding = false;
+	} else if (status != MEVCLI_YIELD) {
+		mevcli_cmd_complete(ctx, status);
+	}
+	mevcli_flush(ctx);
+
+	/* (The input kept meanwhile might've started another) */
+	return ctx->pending && ctx->yielding;
+}
+
+void	*mevcli_task_state(mevcli_ctx_t *ctx)
+{
+	return ctx->task_state;
+}
+#endif
+
+#if MEVCLI_LOG_BUFLEN > 0
+void	mevcli_log(mevcli_ctx_t *ctx, const char *msg)
+{
+	unsigned int head = ctx->log_head;
+	unsigned int space = MEVCLI_LOG_BUFLEN - (head - ctx->log_tail);
+	unsigned int len = mevcli_strlen(msg);
+
+	if (len + 1 > space) {
+		ctx->log_dropped++;
+		return;
+	}
+	for (unsigned int i = 0; i < len; i++)
+		ctx->log_ring[(head + i) & (MEVCLI_LOG_BUFLEN - 1)] = msg[i];
+	ctx->log_ring[(head + len) & (MEVCLI_LOG_BUFLEN - 1)] = '\n';
+	MEVCLI_BARRIER();
+	ctx->log_head = head + len + 1;
+}
+
+void	mevcli_log_flush(mevcli_ctx_t *ctx)
+{
+	mevcli_log_draw(ctx);
+	mevcli_flush(ctx);
+}
+#endif
+
+#if MEVCLI_FEAT_HISTORY_STORE
+int	mevcli_history_load(mevcli_ctx_t *ctx, const mevcli_hist_store_t *store)
+{
+	char hdr[MEVCLI_HIST_HDR_LEN];
+	unsigned int offset = MEVCLI_HIST_MAGIC_LEN;
+	int n = 0;
+	int r;
+
+	MEVCLI_ASSERT(store->size >= MEVCLI_HIST_MAGIC_LEN + MEVCLI_HIST_HDR_LEN +
+		      MEVCLI_MAX_LINE_LEN);
+	ctx->hist_store = store;
+	/* Unless an intact log is found, rewrite it on the first save */
+	ctx->hist_store_end = store->size;
+
+	r = store->read(store->opaque, 0, hdr, MEVCLI_HIST_MAGIC_LEN);
+	if (r < 0)
+		return r;
+	for (unsigned int i = 0; i < MEVCLI_HIST_MAGIC_LEN; i++) {
+		if (hdr[i] != MEVCLI_HIST_MAGIC[i])
+			return 0;
+	}
+
+	while (offset + MEVCLI_HIST_HDR_LEN <= store->size) {
+		r = store->read(store->opaque, offset, hdr, MEVCLI_HIST_HDR_LEN);
+		if (r < 0)
+			return r;
+
+		unsigned int len = (uint8_t)hdr[0] | ((uint8_t)hdr[1] << 8);
+		uint16_t crc = (uint8_t)hdr[2] | ((uint8_t)hdr[3] << 8);
+
+		if (len == 0xffff && crc == 0xffff)
+			break;		/* Erased: the end of the log */
+		if (len == 0 || len > MEVCLI_MAX_LINE_LEN ||
+		    offset + MEVCLI_HIST_HDR_LEN + len > store->size)
+			return n;
+
+		/* Nothing is being edited yet, so use backup_line */
+		r = store->read(store->opaque, offset + MEVCLI_HIST_HDR_LEN,
+				ctx->backup_line, len);
+		if (r < 0)
+			return r;
+		if (mevcli_crc16(mevcli_crc16(0xffff, hdr, 2), ctx->backup_line, len) != crc)
+			return n;
+
+		mevcli_history_append(ctx, ctx->backup_line, len);
+		offset += MEVCLI_HIST_HDR_LEN + len;
+		n++;
+	}
+	ctx->hist_store_end = offset;
+	return n;
+}
+
+int	mevcli_history_save(mevcli_ctx_t *ctx)
+{
+	const mevcli_hist_store_t *store = ctx->hist_store;
+	unsigned int offset = MEVCLI_HIST_MAGIC_LEN;
+	unsigned int n;
+	int r;
+
+	MEVCLI_ASSERT(store);
+
+	/* Keep as many of the newest entries as fit */
+	unsigned int total = offset;
+	for (n = 0; n < ctx->hist_num; n++) {
+		unsigned int len = mevcli_history_text_len(ctx, n);
+		if (total + MEVCLI_HIST_HDR_LEN + len > store->size)
+			break;
+		total += MEVCLI_HIST_HDR_LEN + len;
+	}
+
+	ctx->hist_store_end = store->size;	/* Until it's all written */
+	r = store->erase(store->opaque);
+	if (r == 0)
+		r = store->write(store->opaque, 0, MEVCLI_HIST_MAGIC, MEVCLI_HIST_MAGIC_LEN);
+	while (r == 0 && n > 0) {
+		unsigned int len = mevcli_history_text_len(ctx, --n);
+
+		r = mevcli_history_store_write(ctx, offset, n, len);
+		offset += MEVCLI_HIST_HDR_LEN + len;
+	}
+	if (r == 0)
+		ctx->hist_store_end = offset;
+	return r;
+}
+#endif
+
+#if MEVCLI_FEAT_HISTORY_COMPRESS
+void	mevcli_set_history_dict(mevcli_ctx_t *ctx, const char *const *words)
+{
+	MEVCLI_ASSERT(ctx->hist_num == 0);
+	ctx->hist_dict = words;
+}
+#endif
+
+#if MEVCLI_RXRING_LEN > 0
+void	mevcli_isr_push(mevcli_ctx_t *ctx, char in)
+{
+	unsigned int head = ctx->rx_head;
+	unsigned int used = head - ctx->rx_tail;
+
+	if (used >= MEVCLI_RXRING_LEN) {
+		ctx->rx_overflows++;
+		return;
+	}
+	ctx->rxring[head & (MEVCLI_RXRING_LEN - 1)] = in;
+	MEVCLI_BARRIER();
+	ctx->rx_head = head + 1;
+
+	if (used + 1 >= MEVCLI_RXRING_XOFF && !ctx->rx_stopped) {
+		ctx->rx_stopped = true;
+		if (ctx->cb_rx_flow)
+			ctx->cb_rx_flow(true);
+	}
+}
+
+void	mevcli_poll(mevcli_ctx_t *ctx)
+{
+	unsigned int head = ctx->rx_head;
+	MEVCLI_BARRIER();
+
+	/* Process contiguous chunks in place; the producer can't
+	 * reuse the space until rx_tail moves past it.
+	 */
+	while (ctx->rx_tail != head) {
+		unsigned int tail = ctx->rx_tail;
+		unsigned int offs = tail & (MEVCLI_RXRING_LEN - 1);
+		unsigned int len = MEVCLI_RXRING_LEN - offs;
+
+		if (head - tail < len)
+			len = head - tail;
+
+		mevcli_input_run(ctx, &ctx->rxring[offs], len);
+		MEVCLI_BARRIER();
+		ctx->rx_tail = tail + len;
+	}
+
+	if (ctx->rx_stopped &&
+	    (ctx->rx_head - ctx->rx_tail) < MEVCLI_RXRING_XON) {
+		ctx->rx_stopped = false;
+		if (ctx->cb_rx_flow)
+			ctx->cb_rx_flow(false);
+	}
+#if MEVCLI_FEAT_ASYNC
+	mevcli_tick(ctx);
+#endif
+#if MEVCLI_LOG_BUFLEN > 0
+	mevcli_log_draw(ctx);
+#endif
+	mevcli_flush(ctx);
+}
+
+void	mevcli_set_rx_flow(mevcli_ctx_t *ctx, void (*cb_rx_flow)(bool stop))
+{
+	ctx->cb_rx_flow = cb_rx_flow;
+}
+#endif
+
 #endif
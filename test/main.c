@@ -24,22 +24,33 @@
  */
 
 #include <assert.h>
-#include <ctype.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Override some default before including mevcli.h: */
 #define MEVCLI_PROMPT   	_prompt
 #define MEVCLI_ASSERT(x)	assert(x)
+#define MEVCLI_OUTBUF_LEN	256
+#define MEVCLI_FEAT_BRACKETED_PASTE	1
+#define MEVCLI_FEAT_CMD_INDEX	1
+#define MEVCLI_TRIE_NODES	64	/* Allows e.g. "prb" for "prback" */
+#define MEVCLI_FEAT_TYPED_ARGS	1
+#define MEVCLI_FEAT_ASYNC	1
+#define MEVCLI_LOG_BUFLEN	256
+#define MEVCLI_FEAT_HISTORY_STORE	1
+#define MEVCLI_FEAT_HISTORY_COMPRESS	1
 #define MEVCLI_EXTRA_HELPSTRING	"\r\n" \
 	"\t[ You can navigate a line using cursors (use them with CTRL\r\n" \
 	"\t  to navigate by word), and ^A/^E to skip to the start/end.\r\n" \
-	"\t  Erase by word (^W), or to line start (^U) are also supported. ]\r\n"
+	"\t  Erase by word (^W), or to line start (^U) are also supported.\r\n" \
+	"\t  Tab completes commands, and tab-tab lists the options. ]\r\n"
 
 static char _prompt[128];
 static bool _quit = false;
@@ -48,30 +59,35 @@ static bool _quit = false;
 
 
 
-static void cmd_pback(void *opaque, int argc, char **argv)
+/* Output from handlers goes through mevcli_printf(), so mevcli's
+ * output buffering, rather than stdio:
+ */
+static int cmd_pback(mevcli_ctx_t *ctx, void *opaque, int argc, char **argv)
 {
-	printf("Got %d args.", argc);
+	mevcli_printf(ctx, "Got %d args.", argc);
 	if (argc > 0) {
-		printf("  In reverse order, they are: ");
+		mevcli_printf(ctx, "  In reverse order, they are: ");
 		for (int i = argc - 1; i >= 0; i--) {
-			printf("'%s' ", argv[i]);
+			mevcli_printf(ctx, "'%s' ", argv[i]);
 		}
 	}
-	printf("\r\n");
+	mevcli_printf(ctx, "\r\n");
+	return MEVCLI_OK;
 }
 
-static void cmd_pcaps(void *opaque, int argc, char **argv)
+static int cmd_pcaps(mevcli_ctx_t *ctx, void *opaque, int argc, char **argv)
 {
 	for (int i = 0; i < argc; i++) {
 		char *a = argv[i];
 
-		printf(" '");
-		while (*a) {
-			putchar(toupper(*(a++)));
+		mevcli_printf(ctx, " '");
+		for ( ; *a; a++) {
+			mevcli_printf(ctx, "%c", (*a >= 'a' && *a <= 'z') ? *a - 32 : *a);
 		}
-		printf("'");
+		mevcli_printf(ctx, "'");
 	}
-	printf("\r\n");
+	mevcli_printf(ctx, "\r\n");
+	return MEVCLI_OK;
 }
 
 static void cmd_quit(void *opaque, int argc, char **argv)
@@ -79,6 +95,131 @@ static void cmd_quit(void *opaque, int argc, char **argv)
 	_quit = true;
 }
 
+/* Handlers using typedfn get their args already converted (and checked)
+ * according to the command's argspec:
+ */
+static int cmd_sum(mevcli_ctx_t *ctx, void *opaque, int argc, const mevcli_arg_t *argv)
+{
+	int32_t sum = 0;
+
+	for (int i = 0; i < argc; i++)
+		sum += argv[i].i;
+	mevcli_printf(ctx, "%d (0x%x)\r\n", sum, sum);
+	return MEVCLI_OK;
+}
+
+static const mevcli_argspec_t sum_args[] = {
+	{ .type = MEVCLI_ARG_INT, .flags = MEVCLI_ARGF_REPEAT,
+	  .min = -1000000, .max = 1000000 },
+};
+
+/* "wait" carries on in the background, and is finished from the main
+ * loop (meanwhile, typing is kept until it's done):
+ */
+static int _wait_ticks = -1;	/* Tenths of a second left, or -1 */
+
+static int cmd_wait(mevcli_ctx_t *ctx, void *opaque, int argc, const mevcli_arg_t *argv)
+{
+	_wait_ticks = argv[0].u * 10;
+	return MEVCLI_PENDING;
+}
+
+static void cancel_wait(mevcli_ctx_t *ctx, void *opaque)
+{
+	_wait_ticks = -1;
+	mevcli_printf(ctx, "Cancelled.\r\n");
+	mevcli_cmd_complete(ctx, 1);
+}
+
+static const mevcli_argspec_t wait_args[] = {
+	{ .type = MEVCLI_ARG_UINT, .min = 1, .max = 60 },
+};
+
+/* "count" works in slices, called again from mevcli_tick() in the main
+ * loop until it's done:
+ */
+static int cmd_count(mevcli_ctx_t *ctx, void *opaque, int argc, const mevcli_arg_t *argv)
+{
+	uint32_t *i = mevcli_task_state(ctx);
+
+	MEVCLI_PT_BEGIN(ctx);
+	for (*i = 1; *i <= argv[0].u; (*i)++) {
+		mevcli_printf(ctx, "%u\r\n", *i);
+		MEVCLI_PT_YIELD(ctx);
+	}
+	MEVCLI_PT_END(ctx);
+	return MEVCLI_OK;
+}
+
+static void cancel_count(mevcli_ctx_t *ctx, void *opaque)
+{
+	mevcli_cmd_complete(ctx, 1);
+}
+
+static const mevcli_argspec_t count_args[] = {
+	{ .type = MEVCLI_ARG_UINT, .min = 1, .max = 100000 },
+};
+
+/* Background activity can use mevcli_log() to print above the line
+ * being edited; here, "logticks on" makes the main loop do that.
+ */
+static bool _log_ticks = false;
+
+static int cmd_logticks(mevcli_ctx_t *ctx, void *opaque, int argc, const mevcli_arg_t *argv)
+{
+	_log_ticks = argv[0].b;
+	return MEVCLI_OK;
+}
+
+static const mevcli_argspec_t logticks_args[] = {
+	{ .type = MEVCLI_ARG_BOOL },
+};
+
+/* Arg completer for cmd_machine */
+static const char *complete_onoff(void *opaque, int argn, unsigned int n)
+{
+	static const char *vals[] = { "on", "off" };
+
+	if (argn != 0 || n >= 2)
+		return NULL;
+	return vals[n];
+}
+
+/* Handlers using ctxfn get the mevcli context, and return a status */
+static int cmd_machine(mevcli_ctx_t *ctx, void *opaque, int argc, char **argv)
+{
+	if (strcmp(argv[0], "on") == 0)
+		mevcli_set_machine_mode(ctx, true);
+	else if (strcmp(argv[0], "off") == 0)
+		mevcli_set_machine_mode(ctx, false);
+	else
+		return 1;
+	return MEVCLI_OK;
+}
+
+static void cmd_prompt_set(void *opaque, int argc, char **argv)
+{
+	snprintf(_prompt, sizeof(_prompt), "%s> ", argv[0]);
+}
+
+static void cmd_prompt_reset(void *opaque, int argc, char **argv)
+{
+	strcpy(_prompt, "test> ");
+}
+
+/* Sub-commands of "prompt", i.e. "prompt set <text>" and "prompt reset" */
+const mevcli_cmd_t prompt_cmds[] = {
+	{ .name = "set",
+	  .help = " <text>		Set the prompt",
+	  .cmdfn = cmd_prompt_set,
+	  .nargs = 1,
+	},
+	{ .name = "reset",
+	  .help = "\t\t\tBack to the usual prompt",
+	  .cmdfn = cmd_prompt_reset,
+	},
+};
+
 /* This command uses the 'opaque' parameter to use a common
  * handler for >1 command, and differentiate invocations.
  */
@@ -94,14 +235,41 @@ const mevcli_cmd_t cmds[] = {
 	/* Two similar commands to demonstrate tab-completion */
 	{ .name = "prback",
 	  .help = " <args...>\tPrint args backwards",
-	  .cmdfn = cmd_pback,
+	  .ctxfn = cmd_pback,
 	  .nargs = -1,
 	},
 	{ .name = "prcaps",
 	  .help = " <a> <b>\t\tPrint both args IN CAPS",
-	  .cmdfn = cmd_pcaps,
+	  .ctxfn = cmd_pcaps,
 	  .nargs = 2,
 	},
+	{ .name = "sum",
+	  .help = " <n...>\t\tAdd numbers (decimal, or hex with 0x)",
+	  .typedfn = cmd_sum,
+	  .argspec = sum_args,
+	  .num_argspecs = 1,
+	},
+	{ .name = "wait",
+	  .help = " <secs>\t\tWait, in the background (^C cancels)",
+	  .typedfn = cmd_wait,
+	  .argspec = wait_args,
+	  .num_argspecs = 1,
+	  .cancel = cancel_wait,
+	},
+	{ .name = "count",
+	  .help = " <n>\t\tCount, a step at a time (^C cancels)",
+	  .typedfn = cmd_count,
+	  .argspec = count_args,
+	  .num_argspecs = 1,
+	  .cancel = cancel_count,
+	},
+	{ .name = "logticks",
+	  .help = " <on|off>\tLog a message every few seconds",
+	  .typedfn = cmd_logticks,
+	  .argspec = logticks_args,
+	  .num_argspecs = 1,
+	  .complete = complete_onoff,
+	},
 	{ .name = "special",
 	  .help = "\t\t\tEnter special mode",
 	  .cmdfn = cmd_special,
@@ -112,6 +280,17 @@ const mevcli_cmd_t cmds[] = {
 	  .cmdfn = cmd_special,
 	  .opaque = (void *)0,
 	},
+	{ .name = "machine",
+	  .help = " <on|off>\tMachine mode, for scripts",
+	  .ctxfn = cmd_machine,
+	  .nargs = 1,
+	  .complete = complete_onoff,
+	},
+	{ .name = "prompt",
+	  .help = " <set|reset>\tChange the prompt",
+	  .subcmds = prompt_cmds,
+	  .num_subcmds = sizeof(prompt_cmds)/sizeof(mevcli_cmd_t),
+	},
 	{ .name = "quit",
 	  .help = "\t\t\tQuit back to sanity",
 	  .cmdfn = cmd_quit
@@ -123,9 +302,74 @@ static void my_putchar(char c)
 	write(1, &c, 1);
 }
 
+/* With MEVCLI_OUTBUF_LEN, output arrives in spans; this saves
+ * a syscall per character.
+ */
+static void my_putbuf(const char *buf, unsigned int len)
+{
+	write(1, buf, len);
+}
+
+/* History can be kept in a file, as it might be in a flash page on an
+ * MCU.  Reads past the end of the file look erased.
+ */
+static int hist_fd = -1;
+
+static int hist_read(void *opaque, unsigned int offset, void *buf, unsigned int len)
+{
+	ssize_t n = pread(hist_fd, buf, len, offset);
+	if (n < 0)
+		return -1;
+	memset((char *)buf + n, 0xff, len - n);
+	return 0;
+}
+
+static int hist_write(void *opaque, unsigned int offset, const void *buf, unsigned int len)
+{
+	return pwrite(hist_fd, buf, len, offset) == len ? 0 : -1;
+}
+
+static int hist_erase(void *opaque)
+{
+	return ftruncate(hist_fd, 0);
+}
+
+static const mevcli_hist_store_t hist_store = {
+	.size = 4096,
+	.read = hist_read,
+	.write = hist_write,
+	.erase = hist_erase,
+};
+
+/* Words stored in history as one byte, like command names */
+static const char *const hist_dict[] = {
+	"on", "off", "set", "reset", NULL
+};
+
 /* All of the line-editing storage/state lives here: */
 static mevcli_ctx_t mcctx;
 
+#ifdef MEVCLI_GEN_INDEX
+/* Built this way (see the Makefile), this file just prints the sorted
+ * command index as a const array, for the program proper to include.
+ * An MCU build can do the same on the host, keeping the index in flash
+ * next to cmds rather than building it into RAM at startup.
+ */
+int main(void)
+{
+	uint16_t index[sizeof(cmds)/sizeof(mevcli_cmd_t)];
+
+	mevcli_build_cmd_index(cmds, sizeof(cmds)/sizeof(mevcli_cmd_t), index);
+	printf("/* Generated from main.c by gen_index; don't edit */\n");
+	printf("static const uint16_t cmds_index[] = {");
+	for (unsigned int i = 0; i < sizeof(cmds)/sizeof(mevcli_cmd_t); i++)
+		printf("%s%u", i ? ", " : " ", index[i]);
+	printf(" };\n");
+	return 0;
+}
+#else
+#include "cmds_index.h"
+
 int main(int argc, char *argv[])
 {
 	/* Let's futz with termio to make things rawwwww */
@@ -145,30 +389,81 @@ int main(int argc, char *argv[])
 		    cmds,
 		    sizeof(cmds)/sizeof(mevcli_cmd_t),
 		    my_putchar);
+	mevcli_set_output_buf(&mcctx, my_putbuf);
+
+	mevcli_set_cmd_index(&mcctx, cmds_index);
+	mevcli_set_history_dict(&mcctx, hist_dict);
+
+	/* If given a filename, keep history there */
+	if (argc > 1) {
+		hist_fd = open(argv[1], O_RDWR | O_CREAT, 0644);
+		if (hist_fd >= 0)
+			mevcli_history_load(&mcctx, &hist_store);
+	}
 
 	/* Process input */
+	bool busy = false;
+	time_t next_log = 0;
+	unsigned int log_count = 0;
 	while (!_quit) {
 		struct pollfd pfd = {
 			.fd = 0, .events = POLLIN
 		};
+		int timeout = -1;
 
-		int r = poll(&pfd, 1, -1);
+		if (busy)
+			timeout = 0;
+		else if (_wait_ticks >= 0)
+			timeout = 100;
+		else if (_log_ticks)
+			timeout = 1000;
 
-		if ((r == 1) && (pfd.revents & POLLIN)) {
-			char c;
-			read(0, &c, 1);
+		int r = poll(&pfd, 1, timeout);
 
-			if (c == '\x03')	/* intr */
+		if ((r == 1) && (pfd.revents & POLLIN)) {
+			char buf[64];
+			ssize_t n = read(0, buf, sizeof(buf));
+			if (n <= 0)
 				break;
 
-			mevcli_input_char(&mcctx, c);
+			/* Pass on everything up to any intr (unless it's
+			 * to cancel a command)
+			 */
+			char *intr = (_wait_ticks < 0 && !busy) ?
+				memchr(buf, '\x03', n) : NULL;
+			if (intr)
+				n = intr - buf;
 
+			mevcli_input_buf(&mcctx, buf, n);
+
+			if (intr)
+				break;
+		} else if (r == 0 && _wait_ticks >= 0) {
+			if (--_wait_ticks <= 0) {
+				_wait_ticks = -1;
+				mevcli_cmd_complete(&mcctx, MEVCLI_OK);
+			}
 		} else if (r < 0) {
 			break;
 		}
+
+		/* Let a yielding command do some more */
+		busy = mevcli_tick(&mcctx);
+
+		if (_log_ticks && time(NULL) >= next_log) {
+			char msg[32];
+
+			snprintf(msg, sizeof(msg), "[ Tick %u ]", log_count++);
+			mevcli_log(&mcctx, msg);
+			mevcli_log_flush(&mcctx);
+			next_log = time(NULL) + 3;
+		}
 	}
 
+	/* Turn off bracketed paste, which mevcli_init() turned on */
+	write(1, "\e[?2004l\r\n", 10);
 	tcsetattr(0, TCSANOW, &tios);
 
 	return 0;
 }
+#endif